@@ -0,0 +1,349 @@
+/*
+ * ChaCha20 stream cipher
+ * https://cr.yp.to/chacha/chacha-20080128.pdf
+ *
+ * Original variant with 64-bit block counter and 64-bit nonce, so that any
+ * payload size can be addressed and keystream at any offset can be computed
+ * directly. Multi-block kernels are selected at runtime (AVX2 on x86-64,
+ * NEON on aarch64), with a portable scalar fallback.
+ */
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include "utils.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHACHA20_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define CHACHA20_NEON
+#endif
+
+typedef unsigned char u8;
+typedef unsigned int  u32;
+typedef unsigned long long u64;
+
+#define CHACHA20_BLOCK_SIZE 64
+
+#define CHACHA20_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA20_QR(a, b, c, d) do {                           \
+    a += b; d ^= a; d = CHACHA20_ROTL(d, 16);                  \
+    c += d; b ^= c; b = CHACHA20_ROTL(b, 12);                  \
+    a += b; d ^= a; d = CHACHA20_ROTL(d, 8);                   \
+    c += d; b ^= c; b = CHACHA20_ROTL(b, 7);                   \
+} while (0)
+
+struct chacha20_ctx {
+    u32 state[16];
+    u8 stream[CHACHA20_BLOCK_SIZE];
+    u32 stream_pos;     // unused keystream bytes start at stream[stream_pos]
+};
+
+/**
+ * chacha20 kernel - XOR nblocks of keystream to data
+ * @state: cipher state, block counter in state[12..13] is advanced by nblocks
+ * @data: data to be XOR'ed, nblocks * 64 bytes
+ * @nblocks: number of blocks
+ */
+typedef void (*chacha20_kernel_t)(u32 *state, u8 *data, size_t nblocks);
+
+static inline u32 chacha20_load32(const u8 *p) {
+    return (u32) p[0] | ((u32) p[1] << 8) | ((u32) p[2] << 16) | ((u32) p[3] << 24);
+}
+
+static inline void chacha20_store32(u8 *p, u32 v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline void chacha20_next_counter(u32 *state, u64 n) {
+    u64 counter = ((u64) state[13] << 32 | state[12]) + n;
+    state[12] = (u32) counter;
+    state[13] = (u32) (counter >> 32);
+}
+
+static void chacha20_block(const u32 *state, u32 *out) {
+    u32 x[16];
+    memcpy(x, state, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        CHACHA20_QR(x[0], x[4], x[8],  x[12]);
+        CHACHA20_QR(x[1], x[5], x[9],  x[13]);
+        CHACHA20_QR(x[2], x[6], x[10], x[14]);
+        CHACHA20_QR(x[3], x[7], x[11], x[15]);
+        CHACHA20_QR(x[0], x[5], x[10], x[15]);
+        CHACHA20_QR(x[1], x[6], x[11], x[12]);
+        CHACHA20_QR(x[2], x[7], x[8],  x[13]);
+        CHACHA20_QR(x[3], x[4], x[9],  x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+        out[i] = x[i] + state[i];
+}
+
+static void chacha20_xor_scalar(u32 *state, u8 *data, size_t nblocks) {
+    u32 x[16];
+    for (; nblocks > 0; nblocks--) {
+        chacha20_block(state, x);
+        for (int i = 0; i < 16; i++, data += 4)
+            chacha20_store32(data, chacha20_load32(data) ^ x[i]);
+        chacha20_next_counter(state, 1);
+    }
+}
+
+#ifdef CHACHA20_AVX2
+#define CHACHA20_AVX2_ROTL(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define CHACHA20_AVX2_QR(a, b, c, d) do {                                                       \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot16); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA20_AVX2_ROTL(b, 12);     \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot8);  \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA20_AVX2_ROTL(b, 7);      \
+} while (0)
+
+// transpose 8 registers holding one state word of 8 blocks each into 8 registers
+// holding 8 consecutive state words of one block each
+__attribute__((target("avx2")))
+static inline void chacha20_avx2_transpose(__m256i *x) {
+    __m256i t0 = _mm256_unpacklo_epi32(x[0], x[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(x[0], x[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(x[2], x[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(x[2], x[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(x[4], x[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(x[4], x[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(x[6], x[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(x[6], x[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+    x[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    x[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    x[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    x[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    x[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    x[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    x[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    x[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+__attribute__((target("avx2")))
+static void chacha20_xor_avx2(u32 *state, u8 *data, size_t nblocks) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                          3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (; nblocks >= 8; nblocks -= 8, data += 8 * CHACHA20_BLOCK_SIZE) {
+        __m256i in[16], x[16];
+        for (int i = 0; i < 16; i++)
+            in[i] = _mm256_set1_epi32(state[i]);
+        // per-lane block counter with carry into the high word
+        in[12] = _mm256_add_epi32(in[12], lanes);
+        __m256i carry = _mm256_cmpgt_epi32(_mm256_xor_si256(lanes, _mm256_set1_epi32(INT32_MIN)),
+                                           _mm256_xor_si256(in[12], _mm256_set1_epi32(INT32_MIN)));
+        in[13] = _mm256_sub_epi32(in[13], carry);
+        for (int i = 0; i < 16; i++)
+            x[i] = in[i];
+        for (int i = 0; i < 10; i++) {
+            CHACHA20_AVX2_QR(x[0], x[4], x[8],  x[12]);
+            CHACHA20_AVX2_QR(x[1], x[5], x[9],  x[13]);
+            CHACHA20_AVX2_QR(x[2], x[6], x[10], x[14]);
+            CHACHA20_AVX2_QR(x[3], x[7], x[11], x[15]);
+            CHACHA20_AVX2_QR(x[0], x[5], x[10], x[15]);
+            CHACHA20_AVX2_QR(x[1], x[6], x[11], x[12]);
+            CHACHA20_AVX2_QR(x[2], x[7], x[8],  x[13]);
+            CHACHA20_AVX2_QR(x[3], x[4], x[9],  x[14]);
+        }
+        for (int i = 0; i < 16; i++)
+            x[i] = _mm256_add_epi32(x[i], in[i]);
+        chacha20_avx2_transpose(x);
+        chacha20_avx2_transpose(x + 8);
+        for (int b = 0; b < 8; b++) {
+            __m256i *p = (__m256i*) (data + b * CHACHA20_BLOCK_SIZE);
+            _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), x[b]));
+            _mm256_storeu_si256(p + 1, _mm256_xor_si256(_mm256_loadu_si256(p + 1), x[b + 8]));
+        }
+        chacha20_next_counter(state, 8);
+    }
+    chacha20_xor_scalar(state, data, nblocks);
+}
+#endif
+
+#ifdef CHACHA20_NEON
+#define CHACHA20_NEON_ROTL(v, n) vsriq_n_u32(vshlq_n_u32(v, n), v, 32 - (n))
+#define CHACHA20_NEON_QR(a, b, c, d) do {                                                                 \
+    a = vaddq_u32(a, b); d = veorq_u32(d, a); d = vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(d))); \
+    c = vaddq_u32(c, d); b = veorq_u32(b, c); b = CHACHA20_NEON_ROTL(b, 12);                              \
+    a = vaddq_u32(a, b); d = veorq_u32(d, a); d = CHACHA20_NEON_ROTL(d, 8);                               \
+    c = vaddq_u32(c, d); b = veorq_u32(b, c); b = CHACHA20_NEON_ROTL(b, 7);                               \
+} while (0)
+
+static void chacha20_xor_neon(u32 *state, u8 *data, size_t nblocks) {
+    static const u32 lane_init[4] = { 0, 1, 2, 3 };
+    const uint32x4_t lanes = vld1q_u32(lane_init);
+    for (; nblocks >= 4; nblocks -= 4, data += 4 * CHACHA20_BLOCK_SIZE) {
+        uint32x4_t in[16], x[16];
+        for (int i = 0; i < 16; i++)
+            in[i] = vdupq_n_u32(state[i]);
+        // per-lane block counter with carry into the high word
+        in[12] = vaddq_u32(in[12], lanes);
+        in[13] = vsubq_u32(in[13], vcltq_u32(in[12], lanes));
+        for (int i = 0; i < 16; i++)
+            x[i] = in[i];
+        for (int i = 0; i < 10; i++) {
+            CHACHA20_NEON_QR(x[0], x[4], x[8],  x[12]);
+            CHACHA20_NEON_QR(x[1], x[5], x[9],  x[13]);
+            CHACHA20_NEON_QR(x[2], x[6], x[10], x[14]);
+            CHACHA20_NEON_QR(x[3], x[7], x[11], x[15]);
+            CHACHA20_NEON_QR(x[0], x[5], x[10], x[15]);
+            CHACHA20_NEON_QR(x[1], x[6], x[11], x[12]);
+            CHACHA20_NEON_QR(x[2], x[7], x[8],  x[13]);
+            CHACHA20_NEON_QR(x[3], x[4], x[9],  x[14]);
+        }
+        for (int i = 0; i < 16; i++)
+            x[i] = vaddq_u32(x[i], in[i]);
+        // transpose each group of 4 words so that every register holds one block
+        for (int w = 0; w < 16; w += 4) {
+            uint32x4x2_t a = vtrnq_u32(x[w], x[w + 1]);
+            uint32x4x2_t b = vtrnq_u32(x[w + 2], x[w + 3]);
+            uint32x4_t blk[4] = {
+                vcombine_u32(vget_low_u32(a.val[0]), vget_low_u32(b.val[0])),
+                vcombine_u32(vget_low_u32(a.val[1]), vget_low_u32(b.val[1])),
+                vcombine_u32(vget_high_u32(a.val[0]), vget_high_u32(b.val[0])),
+                vcombine_u32(vget_high_u32(a.val[1]), vget_high_u32(b.val[1])),
+            };
+            for (int b = 0; b < 4; b++) {
+                u8 *p = data + b * CHACHA20_BLOCK_SIZE + w * 4;
+                vst1q_u8(p, veorq_u8(vld1q_u8(p), vreinterpretq_u8_u32(blk[b])));
+            }
+        }
+        chacha20_next_counter(state, 4);
+    }
+    chacha20_xor_scalar(state, data, nblocks);
+}
+#endif
+
+FORCE_INLINE chacha20_kernel_t chacha20_select_kernel() {
+#if defined(CHACHA20_AVX2)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? chacha20_xor_avx2 : chacha20_xor_scalar;
+#elif defined(CHACHA20_NEON)
+    return chacha20_xor_neon;
+#else
+    return chacha20_xor_scalar;
+#endif
+}
+
+// called from cipher_crypt_parallel workers, initialization of a local static is thread-safe
+FORCE_INLINE chacha20_kernel_t chacha20_get_kernel() {
+    static const chacha20_kernel_t kernel = chacha20_select_kernel();
+    return kernel;
+}
+
+/**
+ * chacha20_init - setup ChaCha20 state
+ * @ctx: ChaCha20 context to initialize
+ * @key: key of any length, expanded to 256 bits with one ChaCha20 block
+ * @keylen: key length
+ * @nonce: 64-bit nonce, payloads sharing a key must use different nonces
+ */
+FORCE_INLINE void chacha20_init(struct chacha20_ctx *ctx, const u8 *key, size_t keylen, u64 nonce)
+{
+    u32 *s = ctx->state, x[16];
+    s[0] = 0x61707865; s[1] = 0x3320646e; s[2] = 0x79622d32; s[3] = 0x6b206574;
+    u8 k[32];
+    for (int i = 0; i < 32; i++)
+        k[i] = keylen ? key[i % keylen] ^ (u8) (i / keylen) : 0;
+    for (int i = 0; i < 8; i++)
+        s[4 + i] = chacha20_load32(k + i * 4);
+    s[12] = s[13] = s[14] = s[15] = 0;
+    chacha20_block(s, x);
+    memcpy(s + 4, x, 32);
+    s[14] = (u32) nonce;
+    s[15] = (u32) (nonce >> 32);
+    ctx->stream_pos = CHACHA20_BLOCK_SIZE;
+    memset(k, 0, sizeof(k));
+    memset(x, 0, sizeof(x));
+}
+
+/**
+ * chacha20_seek - move keystream position
+ * @ctx: ChaCha20 context
+ * @offset: absolute byte offset in the keystream
+ *
+ * Unlike RC4, this takes constant time.
+ */
+FORCE_INLINE void chacha20_seek(struct chacha20_ctx *ctx, u64 offset)
+{
+    ctx->state[12] = (u32) (offset / CHACHA20_BLOCK_SIZE);
+    ctx->state[13] = (u32) (offset / CHACHA20_BLOCK_SIZE >> 32);
+    ctx->stream_pos = CHACHA20_BLOCK_SIZE;
+    u32 rem = offset % CHACHA20_BLOCK_SIZE;
+    if (rem) {
+        memset(ctx->stream, 0, sizeof(ctx->stream));
+        chacha20_xor_scalar(ctx->state, ctx->stream, 1);
+        ctx->stream_pos = rem;
+    }
+}
+
+/**
+ * chacha20_crypt - XOR the next part of ChaCha20 stream to given data
+ * @ctx: ChaCha20 context, keystream position is advanced by data_len
+ * @data: data to be XOR'ed with ChaCha20 stream
+ * @data_len: buf length
+ */
+FORCE_INLINE void chacha20_crypt(struct chacha20_ctx *ctx, u8 *data, size_t data_len)
+{
+    while (data_len > 0 && ctx->stream_pos < CHACHA20_BLOCK_SIZE) {
+        *data++ ^= ctx->stream[ctx->stream_pos++];
+        data_len--;
+    }
+    size_t nblocks = data_len / CHACHA20_BLOCK_SIZE;
+    if (nblocks) {
+        chacha20_get_kernel()(ctx->state, data, nblocks);
+        data += nblocks * CHACHA20_BLOCK_SIZE;
+        data_len -= nblocks * CHACHA20_BLOCK_SIZE;
+    }
+    if (data_len) {
+        memset(ctx->stream, 0, sizeof(ctx->stream));
+        chacha20_xor_scalar(ctx->state, ctx->stream, 1);
+        for (ctx->stream_pos = 0; ctx->stream_pos < data_len; ctx->stream_pos++)
+            data[ctx->stream_pos] ^= ctx->stream[ctx->stream_pos];
+    }
+}
+
+/**
+ * chacha20_mac - compute 128-bit keyed tag of data
+ * @key: key of any length, expanded like chacha20_init
+ * @tag: receives 16 bytes
+ *
+ * Cascade of ChaCha20 blocks: each 8-byte chunk of data is put in the nonce words
+ * of a block keyed with the previous chaining value, then a block with the data
+ * length and a distinct counter gives the tag, so that the chaining value never
+ * leaves this function.
+ */
+FORCE_INLINE void chacha20_mac(const u8 *key, size_t keylen, const u8 *data, size_t data_len, u8 *tag)
+{
+    struct chacha20_ctx ctx;
+    chacha20_init(&ctx, key, keylen, 0);
+    u32 *s = ctx.state, x[16];
+    for (size_t pos = 0; pos < data_len; pos += 8) {
+        u8 chunk[8] = {0};
+        memcpy(chunk, data + pos, data_len - pos < 8 ? data_len - pos : 8);
+        s[12] = s[13] = 0;
+        s[14] = chacha20_load32(chunk);
+        s[15] = chacha20_load32(chunk + 4);
+        chacha20_block(s, x);
+        memcpy(s + 4, x, 32);
+    }
+    s[12] = 1;
+    s[13] = 0;
+    s[14] = (u32) data_len;
+    s[15] = (u32) ((u64) data_len >> 32);
+    chacha20_block(s, x);
+    for (int i = 0; i < 4; i++)
+        chacha20_store32(tag + i * 4, x[i]);
+    memset(&ctx, 0, sizeof(ctx));
+    memset(x, 0, sizeof(x));
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <string.h>
+#include "utils.h"
+#ifdef CHACHA20
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include "chacha20.h"
+#else
+#include "rc4.h"
+#endif
+
+// payload cipher selected at build time, rc4 by default, chacha20 with -DCHACHA20.
+// each payload is encrypted as an independent stream identified by a stream id.
+
+#define CIPHER_STREAM_SCRIPT   's'
+#define CIPHER_STREAM_EMBED    'i'
+#define CIPHER_STREAM_SQUASHFS 'm'
+#define CIPHER_STREAM_DICT     'z'
+
+#ifdef CHACHA20
+// keystream at any offset can be computed directly
+#define CIPHER_SEEKABLE
+typedef struct chacha20_ctx cipher_ctx_t;
+#else
+typedef struct rc4_ctx cipher_ctx_t;
+#endif
+
+FORCE_INLINE void cipher_init(cipher_ctx_t *ctx, const char *key, unsigned stream)
+{
+#ifdef CHACHA20
+    chacha20_init(ctx, (const u8*) key, strlen(key), stream);
+#else
+    rc4_init(ctx, (const u8*) key, strlen(key));
+#endif
+}
+
+/**
+ * cipher_seek - move keystream to the given absolute offset
+ *
+ * Constant time if CIPHER_SEEKABLE is defined. For rc4, the context has to be
+ * freshly initialized and the keystream is generated and thrown away.
+ */
+FORCE_INLINE void cipher_seek(cipher_ctx_t *ctx, size_t offset)
+{
+#ifdef CHACHA20
+    chacha20_seek(ctx, offset);
+#else
+    rc4_crypt(ctx, NULL, offset);
+#endif
+}
+
+FORCE_INLINE void cipher_crypt(cipher_ctx_t *ctx, void *data, size_t len)
+{
+#ifdef CHACHA20
+    chacha20_crypt(ctx, (u8*) data, len);
+#else
+    rc4_crypt(ctx, (u8*) data, len);
+#endif
+}
+
+FORCE_INLINE void cipher_clear(cipher_ctx_t *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+#ifdef CIPHER_SEEKABLE
+#define CIPHER_PARALLEL_CHUNK   (1 << 20)
+#define CIPHER_PARALLEL_MIN     (4 << 20)
+#define CIPHER_PARALLEL_THREADS 16
+
+/**
+ * cipher_crypt_parallel - XOR keystream to a large buffer on multiple threads
+ * @ctx: freshly initialized cipher context, not modified
+ * @offset: keystream offset of the first byte of data
+ *
+ * The buffer is split into chunks taken by worker threads in turn, each worker
+ * seeks its own copy of the context to the chunk offset. Output is identical
+ * to a single cipher_crypt() call.
+ */
+FORCE_INLINE void cipher_crypt_parallel(const cipher_ctx_t *ctx, size_t offset, void *data, size_t len)
+{
+    size_t nchunks = (len + CIPHER_PARALLEL_CHUNK - 1) / CIPHER_PARALLEL_CHUNK;
+    size_t nthreads = std::min<size_t>(std::min<size_t>(std::thread::hardware_concurrency(), CIPHER_PARALLEL_THREADS), nchunks);
+    if (len < CIPHER_PARALLEL_MIN || nthreads < 2) {
+        cipher_ctx_t c = *ctx;
+        cipher_seek(&c, offset);
+        cipher_crypt(&c, data, len);
+        cipher_clear(&c);
+        return;
+    }
+    std::atomic<size_t> next(0);
+    auto worker = [&] () {
+        cipher_ctx_t c = *ctx;
+        size_t i;
+        while ((i = next++) < nchunks) {
+            size_t off = i * CIPHER_PARALLEL_CHUNK;
+            cipher_seek(&c, offset + off);
+            cipher_crypt(&c, (char*) data + off, std::min<size_t>(CIPHER_PARALLEL_CHUNK, len - off));
+        }
+        cipher_clear(&c);
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nthreads; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads)
+        t.join();
+}
+#endif
@@ -1,17 +1,42 @@
 #include <stdio.h>
-#include <vector>
+#include <stdlib.h>
 #include "crc32.h"
 #include "utils.h"
 
+// crc32 <file> [skip_offset skip_length]: print crc32 of file, leaving out the specified region
+// crc32 -b <file> <table>: write crc32 of each block of file to table, print crc32 of the table
 int main(int argc, const char **argv) {
     if (argc < 2) {
         return 1;
     }
-    std::vector<char> data;
-    if (read_all(argv[1], data) != 0) {
-        LOGE("failed to read file");
-        return 1;
+    uint32_t crc32;
+    if (strcmp(argv[1], "-b") == 0) {
+        if (argc < 4) {
+            return 1;
+        }
+        std::vector<uint32_t> crcs;
+        if (crc32_file_blocks(argv[2], crcs) != 0) {
+            return 1;
+        }
+        // stored little endian
+        if (is_big_endian()) {
+            for (auto& c : crcs)
+                c = byteswap32(c);
+        }
+        FILE* fp = fopen(argv[3], "wb");
+        if (!fp || fwrite(crcs.data(), sizeof(uint32_t), crcs.size(), fp) != crcs.size() || fclose(fp) != 0) {
+            LOGE("failed to write file");
+            return 1;
+        }
+        crc32 = crc32_fast(crcs.data(), crcs.size() * sizeof(uint32_t), 0);
+    } else {
+        size_t skip_off = argc >= 4 ? strtoull(argv[2], NULL, 10) : 0;
+        size_t skip_len = argc >= 4 ? strtoull(argv[3], NULL, 10) : 0;
+        if (crc32_file(argv[1], &crc32, 0, nullptr, 0, skip_off, skip_len) != 0) {
+            LOGE("failed to read file");
+            return 1;
+        }
     }
-    printf("%u\n", crc32_8bytes(data.data(), data.size(), 0));
+    printf("%u\n", crc32);
     return 0;
 }
@@ -11,7 +11,21 @@
 #include <stdint.h>
 // size_t
 #include <cstddef>
+#include <algorithm>
+#include <thread>
+#include <sys/stat.h>
 #include "utils.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#endif
 
 
 static inline uint32_t byteswap32(uint32_t x) {
@@ -29,7 +43,7 @@ static inline uint32_t byteswap32(uint32_t x) {
 // constants
 
 /// look-up table, already declared above
-static const uint32_t Crc32Lookup[8][256] = {
+static constexpr uint32_t Crc32Lookup[8][256] = {
     {
         // note: the first number of every second row corresponds to the half-byte look-up table !
         0x00000000,0x77073096,0xEE0E612C,0x990951BA,0x076DC419,0x706AF48F,0xE963A535,0x9E6495A3,
@@ -356,3 +370,433 @@ uint32_t crc32_8bytes(const void* data, size_t length, uint32_t previousCrc32) {
 
     return ~crc; // same as crc ^ 0xFFFFFFFF
 }
+
+
+/// tables 8..15 for Slicing-by-16, derived from the ones above at compile time
+struct Crc32LookupHiTables {
+    uint32_t t[8][256];
+};
+
+static constexpr Crc32LookupHiTables make_crc32_lookup_hi() {
+    Crc32LookupHiTables r{};
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = Crc32Lookup[7][i];
+        for (int k = 0; k < 8; k++) {
+            c = (c >> 8) ^ Crc32Lookup[0][c & 0xFF];
+            r.t[k][i] = c;
+        }
+    }
+    return r;
+}
+
+static constexpr Crc32LookupHiTables Crc32LookupHi = make_crc32_lookup_hi();
+
+#define CRC32_LOOKUP(n, x) ((n) < 8 ? Crc32Lookup[(n) & 7][(x) & 0xFF] : Crc32LookupHi.t[(n) & 7][(x) & 0xFF])
+
+/// compute CRC32 (Slicing-by-16 algorithm)
+static inline uint32_t crc32_16bytes(const void* data, size_t length, uint32_t previousCrc32) {
+    uint32_t crc = ~previousCrc32;
+    const uint32_t* current = (const uint32_t*) data;
+
+    if (is_big_endian()) {
+        while (length >= 16) {
+            uint32_t one   = *current++ ^ byteswap32(crc);
+            uint32_t two   = *current++;
+            uint32_t three = *current++;
+            uint32_t four  = *current++;
+            crc = CRC32_LOOKUP( 0, four       ) ^ CRC32_LOOKUP( 1, four  >>  8) ^
+                  CRC32_LOOKUP( 2, four  >> 16) ^ CRC32_LOOKUP( 3, four  >> 24) ^
+                  CRC32_LOOKUP( 4, three      ) ^ CRC32_LOOKUP( 5, three >>  8) ^
+                  CRC32_LOOKUP( 6, three >> 16) ^ CRC32_LOOKUP( 7, three >> 24) ^
+                  CRC32_LOOKUP( 8, two        ) ^ CRC32_LOOKUP( 9, two   >>  8) ^
+                  CRC32_LOOKUP(10, two   >> 16) ^ CRC32_LOOKUP(11, two   >> 24) ^
+                  CRC32_LOOKUP(12, one        ) ^ CRC32_LOOKUP(13, one   >>  8) ^
+                  CRC32_LOOKUP(14, one   >> 16) ^ CRC32_LOOKUP(15, one   >> 24);
+            length -= 16;
+        }
+    } else {
+        while (length >= 16) {
+            uint32_t one   = *current++ ^ crc;
+            uint32_t two   = *current++;
+            uint32_t three = *current++;
+            uint32_t four  = *current++;
+            crc = CRC32_LOOKUP( 0, four  >> 24) ^ CRC32_LOOKUP( 1, four  >> 16) ^
+                  CRC32_LOOKUP( 2, four  >>  8) ^ CRC32_LOOKUP( 3, four       ) ^
+                  CRC32_LOOKUP( 4, three >> 24) ^ CRC32_LOOKUP( 5, three >> 16) ^
+                  CRC32_LOOKUP( 6, three >>  8) ^ CRC32_LOOKUP( 7, three      ) ^
+                  CRC32_LOOKUP( 8, two   >> 24) ^ CRC32_LOOKUP( 9, two   >> 16) ^
+                  CRC32_LOOKUP(10, two   >>  8) ^ CRC32_LOOKUP(11, two        ) ^
+                  CRC32_LOOKUP(12, one   >> 24) ^ CRC32_LOOKUP(13, one   >> 16) ^
+                  CRC32_LOOKUP(14, one   >>  8) ^ CRC32_LOOKUP(15, one        );
+            length -= 16;
+        }
+    }
+
+    const uint8_t* currentChar = (const uint8_t*) current;
+    while (length-- != 0)
+        crc = (crc >> 8) ^ Crc32Lookup[0][(crc & 0xFF) ^ *currentChar++];
+
+    return ~crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/// fold 16-byte blocks with carry-less multiplication, length must be a multiple of 16 and at least 64.
+/// crc is the raw (inverted) register. constants and algorithm follow Intel's paper
+/// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", as used in zlib of chromium.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(const uint8_t* buf, size_t len, uint32_t crc) {
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*) k1k2);
+    buf += 64;
+    len -= 64;
+
+    // fold 4 blocks in parallel
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    // fold into 128 bits
+    x0 = _mm_load_si128((const __m128i*) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // fold remaining single blocks
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*) buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    // fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(const void* data, size_t length, uint32_t previousCrc32) {
+    if (length < 64)
+        return crc32_16bytes(data, length, previousCrc32);
+    size_t chunk = length & ~(size_t) 15;
+    uint32_t crc = ~crc32_pclmul_fold((const uint8_t*) data, chunk, ~previousCrc32);
+    return crc32_16bytes((const uint8_t*) data + chunk, length - chunk, crc);
+}
+#elif defined(__aarch64__)
+/// armv8 crc32 instructions, 8 bytes per instruction
+__attribute__((target("arch=armv8-a+crc")))
+static uint32_t crc32_armv8(const void* data, size_t length, uint32_t previousCrc32) {
+    uint32_t crc = ~previousCrc32;
+    const uint8_t* buf = (const uint8_t*) data;
+    while (length && ((uintptr_t) buf & 7)) {
+        crc = __crc32b(crc, *buf++);
+        length--;
+    }
+    // four independent streams would hide latency, but need crc combine, keep it simple
+    while (length >= 32) {
+        crc = __crc32d(crc, *(const uint64_t*) (buf + 0));
+        crc = __crc32d(crc, *(const uint64_t*) (buf + 8));
+        crc = __crc32d(crc, *(const uint64_t*) (buf + 16));
+        crc = __crc32d(crc, *(const uint64_t*) (buf + 24));
+        buf += 32;
+        length -= 32;
+    }
+    while (length >= 8) {
+        crc = __crc32d(crc, *(const uint64_t*) buf);
+        buf += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = __crc32b(crc, *buf++);
+    }
+    return ~crc;
+}
+#endif
+
+typedef uint32_t (*crc32_func_t)(const void* data, size_t length, uint32_t previousCrc32);
+
+static inline crc32_func_t crc32_select() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        return crc32_pclmul;
+#elif defined(__aarch64__)
+#if defined(__APPLE__) || defined(__ARM_FEATURE_CRC32)
+    return crc32_armv8;
+#elif defined(__linux__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        return crc32_armv8;
+#endif
+#endif
+    return crc32_16bytes;
+}
+
+/// compute CRC32 with the fastest implementation supported by cpu, same result as crc32_8bytes
+static inline uint32_t crc32_fast(const void* data, size_t length, uint32_t previousCrc32) {
+    static const crc32_func_t func = crc32_select();
+    return func(data, length, previousCrc32);
+}
+
+/// multiply a and b modulo the crc polynomial, both in reflected bit order
+static constexpr uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+    }
+    return p;
+}
+
+struct Crc32X2nTable {
+    uint32_t t[32];
+};
+
+/// t[k] = x^(2^k) modulo the crc polynomial
+static constexpr Crc32X2nTable make_crc32_x2n_table() {
+    Crc32X2nTable r{};
+    uint32_t p = 1u << 30;
+    r.t[0] = p;
+    for (int n = 1; n < 32; n++)
+        r.t[n] = p = crc32_multmodp(p, p);
+    return r;
+}
+
+static constexpr Crc32X2nTable Crc32X2n = make_crc32_x2n_table();
+
+/// compute CRC32 of two concatenated blocks from their CRC32s, same as zlib's crc32_combine
+static inline uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    // x^(8 * len2) modulo the polynomial
+    uint32_t p = 1u << 31;
+    for (int k = 3; len2; len2 >>= 1, k++) {
+        if (len2 & 1)
+            p = crc32_multmodp(Crc32X2n.t[k & 31], p);
+    }
+    return crc32_multmodp(p, crc1) ^ crc2;
+}
+
+#define CRC32_FILE_CHUNK (1 << 20)
+#define CRC32_PARALLEL_STRIPE_MIN (8 << 20)
+#define CRC32_PARALLEL_THREADS 16
+
+/// compute CRC32 of len bytes at file offset off, bytes at [patch_off, patch_off + patch_len) are replaced by patch
+static inline int crc32_file_range(int fd, size_t off, size_t len, uint32_t* out, size_t patch_off, const void* patch, size_t patch_len) {
+    std::vector<char> buf(std::min<size_t>(len, CRC32_FILE_CHUNK));
+    uint32_t crc = 0;
+    while (len > 0) {
+        ssize_t n = pread(fd, buf.data(), std::min(buf.size(), len), off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        // patch the part of [patch_off, patch_off + patch_len) that falls in this chunk
+        if (patch && patch_off < off + n && patch_off + patch_len > off) {
+            size_t from = std::max(patch_off, off);
+            size_t to = std::min(patch_off + patch_len, off + n);
+            memcpy(&buf[from - off], (const char*) patch + (from - patch_off), to - from);
+        }
+        crc = crc32_fast(buf.data(), n, crc);
+        off += n;
+        len -= n;
+    }
+    *out = crc;
+    return 0;
+}
+
+/// same as crc32_file_range, large ranges are split into stripes hashed on up to max_threads threads (0 for cpu count)
+static inline int crc32_file_range_parallel(int fd, size_t off, size_t len, uint32_t* out, size_t patch_off, const void* patch, size_t patch_len,
+                                            size_t max_threads = 0) {
+    if (max_threads == 0)
+        max_threads = std::min<size_t>(std::thread::hardware_concurrency(), CRC32_PARALLEL_THREADS);
+    size_t nthreads = std::min<size_t>(max_threads, len / CRC32_PARALLEL_STRIPE_MIN);
+    if (nthreads < 2)
+        return crc32_file_range(fd, off, len, out, patch_off, patch, patch_len);
+    // stripes are ceil(len / nthreads) rounded up to the chunk size, the last one takes what is left, if anything
+    size_t stripe = ((len + nthreads - 1) / nthreads + CRC32_FILE_CHUNK - 1) / CRC32_FILE_CHUNK * CRC32_FILE_CHUNK;
+    std::vector<uint32_t> crcs(nthreads);
+    std::vector<int> rets(nthreads);
+    auto stripe_len = [&] (size_t i) {
+        return i * stripe < len ? std::min(stripe, len - i * stripe) : 0;
+    };
+    auto worker = [&] (size_t i) {
+        rets[i] = crc32_file_range(fd, off + i * stripe, stripe_len(i), &crcs[i], patch_off, patch, patch_len);
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nthreads; i++)
+        threads.emplace_back(worker, i);
+    worker(0);
+    for (auto& t : threads)
+        t.join();
+    uint32_t crc = 0;
+    for (size_t i = 0; i < nthreads; i++) {
+        if (rets[i] != 0)
+            return -1;
+        crc = crc32_combine(crc, crcs[i], stripe_len(i));
+    }
+    *out = crc;
+    return 0;
+}
+
+/**
+ * crc32_file - compute CRC32 of a file with chunked pread, memory use is bounded by the chunk size
+ * @patch_off: file offset of bytes to replace in the checksummed stream, file itself is not modified
+ * @patch: replacement bytes, nullptr for none
+ * @skip_off: file offset of a region left out of the checksummed stream
+ * @skip_len: length of the region, 0 for none
+ *
+ * Large files are split into stripes hashed on multiple threads, stripe CRCs are merged with
+ * crc32_combine(). Returns 0 on success, -1 if the file can't be read or is too short for
+ * the patch or the skipped region.
+ */
+static inline int crc32_file(const char* path, uint32_t* out, size_t patch_off = 0, const void* patch = nullptr, size_t patch_len = 0,
+                             size_t skip_off = 0, size_t skip_len = 0) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        LOGE("failed to open file. path=%s", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOGE("failed to stat file. path=%s", path);
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if ((patch && patch_off + patch_len > size) || skip_off + skip_len > size) {
+        LOGE("file too short. path=%s", path);
+        close(fd);
+        return -1;
+    }
+    if (!skip_len)
+        skip_off = size;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    uint32_t head = 0, tail = 0;
+    size_t tail_off = skip_off + skip_len;
+    int ret = crc32_file_range_parallel(fd, 0, skip_off, &head, patch_off, patch, patch_len);
+    if (ret == 0)
+        ret = crc32_file_range_parallel(fd, tail_off, size - tail_off, &tail, patch_off, patch, patch_len);
+    close(fd);
+    if (ret != 0) {
+        LOGE("failed to read file. path=%s", path);
+        return -1;
+    }
+    *out = crc32_combine(head, tail, size - tail_off);
+    return 0;
+}
+
+#define CRC32_BLOCK_SIZE (64 * 1024)
+
+/// compute CRC32 of each CRC32_BLOCK_SIZE block of a file, the last block may be shorter
+static inline int crc32_file_blocks(const char* path, std::vector<uint32_t>& crcs) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        LOGE("failed to open file. path=%s", path);
+        return -1;
+    }
+    std::vector<char> buf(CRC32_BLOCK_SIZE);
+    crcs.clear();
+    for (;;) {
+        size_t n = 0;
+        while (n < buf.size()) {
+            ssize_t r = read(fd, &buf[n], buf.size() - n);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0) {
+                LOGE("failed to read file. path=%s", path);
+                close(fd);
+                return -1;
+            }
+            if (r == 0)
+                break;
+            n += r;
+        }
+        if (n == 0)
+            break;
+        crcs.push_back(crc32_fast(buf.data(), n, 0));
+        if (n < buf.size())
+            break;
+    }
+    close(fd);
+    return 0;
+}
+
+#ifdef VERIFY_CHECKSUM
+/**
+ * get_cksum_data - checksum info patched into the binary by ssc after build
+ *
+ * [0] offset of this data in the binary
+ * [1] crc32 of the binary with this data restored, excluding the squashfs image
+ * [2] size of the squashfs image appended with -M, followed by a table of block crc32s
+ * [3] crc32 of the block table
+ */
+DISABLE_OPTIMIZATION FORCE_INLINE uint32_t* get_cksum_data() {
+    static uint32_t cksum_data[4];
+    // read through volatile, so the marker stays a single object in the binary for ssc to patch,
+    // instead of immediates spread over every inlined copy
+    static const char marker[] = "ssccksumsqfsleaf";
+    const volatile char* p = marker;
+    for (size_t i = 0; i < sizeof(cksum_data); i++)
+        ((char*) cksum_data)[i] = p[i];
+    if (is_big_endian()) {
+        for (auto& w : cksum_data)
+            w = byteswap32(w);
+    }
+    return cksum_data;
+}
+#endif
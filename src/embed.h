@@ -5,10 +5,17 @@
 #include <unistd.h>
 #include <limits.h>
 #include "utils.h"
-#include "rc4.h"
+#include "cipher.h"
 #ifdef EMBED_ARCHIVE
 #include "untar.h"
 #endif
+#ifdef EXTRACT_CACHE
+#include <algorithm>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#endif
 
 #ifdef __APPLE__
 #include <mach-o/getsect.h>
@@ -35,35 +42,73 @@ FORCE_INLINE std::vector<char> read_data_sect(const char *name) {
 }
 #endif
 
-FORCE_INLINE std::string extract_embeded_file() {
+// embedded data, still encrypted. on macOS it is read into buf
+FORCE_INLINE char* get_embeded_data(std::vector<char>& buf, size_t* size) {
 #ifdef __APPLE__
-    auto buf = read_data_sect("i");
-    if (buf.empty())
-        exit(1);
-    char *data =  buf.data();
-    size_t size = buf.size();
+    buf = read_data_sect("i");
+    *size = buf.size();
+    return buf.data();
 #else
     extern char _binary_i_start;
     extern char _binary_i_end;
-    char *data = &_binary_i_start;
-    size_t size = &_binary_i_end - &_binary_i_start;
+    *size = &_binary_i_end - &_binary_i_start;
+    return &_binary_i_start;
 #endif
+}
 
-    const char* rc4_key = OBF(STR(RC4_KEY));
-    rc4((u8*) data, size, (u8*) rc4_key, strlen(rc4_key));
-    
-    char path[PATH_MAX];
-    strcpy(path, tmpdir());
-    strcat(path, OBF("/ssc.XXXXXX"));
-    if (!mkdtemp(path)) {
-        LOGE("failed to create output directory");
-        exit(1);
+// embedded data is decrypted in place once, however many times it is extracted,
+// and wiped by release_embeded_data() when extraction is over
+static char *embeded_data;
+static size_t embeded_data_size;
+#ifdef __APPLE__
+static std::vector<char> embeded_data_buf;
+#endif
+
+FORCE_INLINE char* decrypt_embeded_data(size_t* size) {
+    if (!embeded_data) {
+#ifdef __APPLE__
+        char *data = get_embeded_data(embeded_data_buf, &embeded_data_size);
+        if (embeded_data_buf.empty())
+            exit(1);
+#else
+        std::vector<char> buf;
+        char *data = get_embeded_data(buf, &embeded_data_size);
+#endif
+        const char* rc4_key = OBF(STR(RC4_KEY));
+        cipher_ctx_t cipher_ctx;
+        cipher_init(&cipher_ctx, rc4_key, CIPHER_STREAM_EMBED);
+#ifdef CIPHER_SEEKABLE
+        cipher_crypt_parallel(&cipher_ctx, 0, data, embeded_data_size);
+#else
+        cipher_crypt(&cipher_ctx, data, embeded_data_size);
+#endif
+        cipher_clear(&cipher_ctx);
+        embeded_data = data;
     }
-    strcat(path, "/");
+    *size = embeded_data_size;
+    return embeded_data;
+}
+
+FORCE_INLINE void release_embeded_data() {
+    if (!embeded_data)
+        return;
+#ifdef __linux__
+    // decrypted data is no longer needed, don't let it stay in memory and be copied by fork
+    wipe_pages(embeded_data, embeded_data_size);
+#endif
+#ifdef __APPLE__
+    std::vector<char>().swap(embeded_data_buf);
+#endif
+}
+
+// extract decrypted embedded data to dir, which ends with '/'
+FORCE_INLINE void extract_embeded_file_to(const char* path) {
+    size_t size;
+    char *data = decrypt_embeded_data(&size);
 
 #if defined(EMBED_INTERPRETER_NAME)
-    strcat(path, base_name(STR(EMBED_INTERPRETER_NAME)).c_str());
-    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC);
+    std::string file_path = path + base_name(STR(EMBED_INTERPRETER_NAME));
+    int fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC);
     if (fd == -1) {
         LOGE("failed to open output file");
         exit(1);
@@ -73,7 +118,7 @@ FORCE_INLINE std::string extract_embeded_file() {
         exit(1);
     }
     close(fd);
-    if (chmod(path, 0755) == -1) {
+    if (chmod(file_path.c_str(), 0755) == -1) {
         LOGE("failed to chmod 755");
         exit(1);
     }
@@ -87,12 +132,191 @@ FORCE_INLINE std::string extract_embeded_file() {
         LOGE("failed to change dir");
         exit(1);
     }
-    if (extract_tar_gz_from_mem(data, size) != 0)
+    if (extract_tar_from_mem(data, size) != 0)
         exit(1);
     if (chdir(cwd) == -1) {
         LOGE("failed to change back dir");
         exit(1);
     }
 #endif
-    return path;
+}
+
+// path of the interpreter for -e, or the dir itself for -E
+FORCE_INLINE std::string embeded_file_path(std::string dir) {
+#if defined(EMBED_INTERPRETER_NAME)
+    dir += base_name(STR(EMBED_INTERPRETER_NAME));
+#endif
+    return dir;
+}
+
+#ifdef EXTRACT_CACHE
+// extracted files are kept in cache dir, under a name derived from the hash of the embedded file.
+// each entry has a lock file, held shared while the entry is in use and exclusive while it's
+// populated or evicted. total size is kept under EXTRACT_CACHE MiB, least recently used first.
+// cached files are used as they are, they can't be trusted more than the cache dir itself.
+#ifdef VERIFY_CHECKSUM
+#error Extraction cache bypasses checksum verification of embedded files!
+#endif
+
+static int extract_cache_lock_fd = -1;
+
+// open and flock a lock file, retry if it was unlinked by an evicting process meanwhile
+FORCE_INLINE int lock_file(const std::string& path, int op) {
+    for (;;) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd == -1)
+            return -1;
+        int r;
+        while ((r = flock(fd, op)) == -1 && errno == EINTR);
+        struct stat st1, st2;
+        if (r == 0 && fstat(fd, &st1) == 0 && stat(path.c_str(), &st2) == 0 &&
+            st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+            return fd;
+        close(fd);
+        if (r != 0)
+            return -1;
+    }
+}
+
+static off_t extract_cache_dir_size;
+
+static int _add_file_size(const char *pathname, const struct stat *sbuf, int type, struct FTW *ftwb) {
+    extract_cache_dir_size += sbuf->st_size;
+    return 0;
+}
+
+FORCE_INLINE off_t get_dir_size(const std::string& dir) {
+    extract_cache_dir_size = 0;
+    nftw(dir.c_str(), _add_file_size, 10, FTW_PHYS);
+    return extract_cache_dir_size;
+}
+
+// remove least recently used entries not in use, until total size is under limit
+FORCE_INLINE void evict_extract_cache(const std::string& root, const std::string& keep) {
+    struct entry { std::string name; time_t mtime; off_t size; };
+    std::vector<entry> entries;
+    auto dir = opendir(root.c_str());
+    if (!dir)
+        return;
+    while (auto ent = readdir(dir)) {
+        std::string name = ent->d_name;
+        std::string path = root + '/' + name;
+        struct stat st;
+        // entries are directories named by key, leftovers of interrupted extraction end with .tmp,
+        // those of interrupted eviction contain .del and are no longer used by anyone
+        if (name[0] != '.' && name.find(OBF(".del.")) != std::string::npos) {
+            remove_directory(path.c_str());
+            continue;
+        }
+        if (name[0] == '.' || name == keep || name.find('.') != std::string::npos || lstat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+        entries.push_back({name, st.st_mtime, get_dir_size(path)});
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end(), [] (const entry& a, const entry& b) { return a.mtime > b.mtime; });
+    off_t total = get_dir_size(root + '/' + keep);
+    for (auto& e : entries) {
+        total += e.size;
+        if (total <= (off_t) EXTRACT_CACHE << 20)
+            continue;
+        std::string lock_path = root + '/' + e.name + OBF(".lock");
+        int fd = lock_file(lock_path, LOCK_EX | LOCK_NB);
+        if (fd == -1)
+            continue;   // in use
+        // move entry out of the way first, a crash while deleting must not leave a partial entry
+        std::string del_path = root + '/' + e.name + OBF(".del.") + rand_str(6);
+        if (rename((root + '/' + e.name).c_str(), del_path.c_str()) != 0) {
+            close(fd);
+            continue;
+        }
+        remove_directory(del_path.c_str());
+        remove_directory((root + '/' + e.name + OBF(".tmp")).c_str());
+        unlink(lock_path.c_str());
+        close(fd);
+        total -= e.size;
+    }
+}
+
+// returns path in cache, empty if cache is not usable
+FORCE_INLINE std::string extract_embeded_file_cached() {
+    std::string root = cache_dir();
+    if (root.empty())
+        return "";
+    root += OBF("/x");
+    mkdir(root.c_str(), 0700);
+    std::string key = OBF(STR(EXTRACT_CACHE_KEY));
+    std::string path = root + '/' + key;
+    std::string lock_path = path + OBF(".lock");
+    // retried if entry is evicted by another process between populating it and taking shared lock
+    int fd = -1;
+    for (int retry = 0; fd == -1 && retry < 3; retry++) {
+        fd = lock_file(lock_path, LOCK_SH);
+        if (fd == -1)
+            return "";
+        if (is_dir(path.c_str()))
+            break;
+        // upgrade to exclusive lock, someone else may have populated it before we get the lock
+        flock(fd, LOCK_UN);
+        close(fd);
+        fd = lock_file(lock_path, LOCK_EX);
+        if (fd == -1)
+            return "";
+        if (!is_dir(path.c_str())) {
+            std::string tmp_path = path + OBF(".tmp");
+            remove_directory(tmp_path.c_str());
+            if (mkdir(tmp_path.c_str(), 0700) != 0) {
+                close(fd);
+                return "";
+            }
+            extract_embeded_file_to((tmp_path + '/').c_str());
+            if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+                remove_directory(tmp_path.c_str());
+                close(fd);
+                return "";
+            }
+            evict_extract_cache(root, key);
+        }
+        // downgrade is not atomic, an evicting process may take the lock in between
+        struct stat st1, st2;
+        if (flock(fd, LOCK_SH) != 0 || !is_dir(path.c_str()) || fstat(fd, &st1) != 0 ||
+            stat(lock_path.c_str(), &st2) != 0 || st1.st_dev != st2.st_dev || st1.st_ino != st2.st_ino) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd == -1)
+        return "";
+    // mtime of entry is its last use
+    utimes(path.c_str(), NULL);
+    extract_cache_lock_fd = fd;
+    return embeded_file_path(path + '/');
+}
+#endif
+
+/**
+ * extract_embeded_file - extract embedded interpreter or archive
+ * @cached: set to whether files are in the persistent cache, otherwise they're in a temporary
+ *          directory that should be removed after use
+ */
+FORCE_INLINE std::string extract_embeded_file(bool* cached) {
+#ifdef EXTRACT_CACHE
+    auto cache_path = extract_embeded_file_cached();
+    if (!cache_path.empty()) {
+        release_embeded_data();
+        *cached = true;
+        return cache_path;
+    }
+#endif
+    *cached = false;
+    char path[PATH_MAX];
+    strcpy(path, tmpdir());
+    strcat(path, OBF("/ssc.XXXXXX"));
+    if (!mkdtemp(path)) {
+        LOGE("failed to create output directory");
+        exit(1);
+    }
+    strcat(path, "/");
+    extract_embeded_file_to(path);
+    release_embeded_data();
+    return embeded_file_path(path);
 }
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <limits.h>
@@ -17,7 +18,7 @@
 #include "obfuscate.h"
 #include "utils.h"
 #include "embed.h"
-#include "rc4.h"
+#include "cipher.h"
 #ifdef __linux__
 #include <sys/mount.h>
 #endif
@@ -25,12 +26,30 @@
 #ifdef UNTRACEABLE
 #include "untraceable.h"
 #endif
-#ifdef MOUNT_SQUASHFS
+#if defined(MOUNT_SQUASHFS) || defined(MOUNT_ARCHIVE)
 #include "mount.h"
 #endif
 #ifdef VERIFY_CHECKSUM
 #include "crc32.h"
 #endif
+#ifdef CHECKSUM_CACHE
+#include "chacha20.h"
+#endif
+#ifdef ZYGOTE
+#include "zygote.h"
+#endif
+#ifdef COMPRESS_SCRIPT
+#include <zstd.h>
+#define SCRIPT_OUT_BUF_SIZE (256 << 10)
+#endif
+
+// child process lingers until interpreter exits to remove temporary files, or to watch for debugger
+#if defined(EMBED_INTERPRETER_NAME) || defined(EMBED_ARCHIVE) || defined(__FreeBSD__) || defined(PS_NAME)
+#define CLEANUP_PROCESS
+#endif
+#if defined(UNTRACEABLE) && defined(WATCHDOG_INTERVAL) && !defined(CLEANUP_PROCESS)
+#define CLEANUP_PROCESS
+#endif
 
 enum ScriptFormat {
     UNKNOWN,
@@ -45,39 +64,284 @@ enum ScriptFormat {
 };
 
 #ifdef VERIFY_CHECKSUM
-DISABLE_OPTIMIZATION FORCE_INLINE uint32_t* get_cksum_data() {
-    static uint32_t cksum_data[2];
-    memcpy(cksum_data, "ssccksum", 8);
-    return cksum_data;
+#ifdef CHECKSUM_CACHE
+// tag of record keyed with payload key, the runtime dir is writable by anyone running as same user
+FORCE_INLINE std::string checksum_cache_tag(const std::string& data) {
+    const char* key = OBF(STR(RC4_KEY));
+    u8 tag[16];
+    chacha20_mac((const u8*) key, strlen(key), (const u8*) data.data(), data.size(), tag);
+    memset((void*) key, 0, strlen(key));
+    char hex[sizeof(tag) * 2 + 1];
+    for (size_t i = 0; i < sizeof(tag); i++)
+        snprintf(hex + i * 2, 3, "%02x", tag[i]);
+    return hex;
 }
-#endif
 
-int main(int argc, char* argv[]) {
-#ifdef UNTRACEABLE
-    check_debugger(true, false);
+// a successful verification is recorded in runtime dir, later runs skip the checksum while the
+// binary keeps the same device, inode, size, mtime and ctime
+FORCE_INLINE std::string checksum_cache_path(const std::string& exe_path, uint32_t crc32, std::string& record) {
+    struct stat st;
+    if (stat(exe_path.c_str(), &st) != 0) {
+        return "";
+    }
+    std::string dir = runtime_dir();
+    if (dir.empty()) {
+        return "";
+    }
+    char name[32];
+    snprintf(name, sizeof(name), OBF("/%016zx.ck"), std::hash<std::string>()(exe_path));
+    std::string data = file_stat_key(st) + ':' + std::to_string(crc32);
+    record = data + ':' + checksum_cache_tag(data + '\0' + exe_path) + '\n';
+    return dir + name;
+}
+
+FORCE_INLINE bool checksum_cache_hit(const std::string& path, const std::string& record) {
+    int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) {
+        return false;
+    }
+    char buf[256];
+    auto n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n == (ssize_t) record.size() && memcmp(buf, record.data(), n) == 0;
+}
+
+// write to a temporary file and rename it, readers never see a partial record
+FORCE_INLINE void checksum_cache_store(const std::string& path, const std::string& record) {
+    std::string tmp_path = path + '.' + rand_str(6);
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return;
+    }
+    bool ok = write_all(fd, record.data(), record.size()) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+    }
+}
 #endif
 
-    std::string exe_path = get_exe_path();
-    
-#ifdef VERIFY_CHECKSUM
+FORCE_INLINE bool verify_checksum(const std::string& exe_path) {
     auto cksum_data = get_cksum_data();
-    if (is_big_endian()) {
-        cksum_data[0] = byteswap32(cksum_data[0]);
-        cksum_data[1] = byteswap32(cksum_data[1]);
+#ifdef CHECKSUM_CACHE
+    // metadata is taken before hashing, a binary modified meanwhile won't match the record
+    std::string record;
+    std::string cache_path = checksum_cache_path(exe_path, cksum_data[1], record);
+    if (!cache_path.empty() && checksum_cache_hit(cache_path, record)) {
+        return true;
     }
-    std::vector<char> exe_data;
-    if (read_all(exe_path.c_str(), exe_data) != 0) {
-        return 1;
+#endif
+    size_t skip_off = 0, skip_len = 0;
+#ifdef MOUNT_SQUASHFS
+    // squashfs image is verified block by block when read, see sqfs_load_block
+    auto image_offset = get_elf_size(exe_path.c_str());
+    if (image_offset < 0) {
+        return false;
+    }
+    skip_off = image_offset;
+    skip_len = cksum_data[2];
+#endif
+    uint32_t crc32;
+    if (crc32_file(exe_path.c_str(), &crc32, cksum_data[0], OBF("ssccksumsqfsleaf"), 16, skip_off, skip_len) != 0) {
+        return false;
     }
-    memcpy(&exe_data[cksum_data[0]], OBF("ssccksum"), 8);
-    auto crc32 = crc32_8bytes(exe_data.data(), exe_data.size(), 0);
     if (crc32 != cksum_data[1]) {
         LOGD("checksum not match! expect=%08x got=%08x", cksum_data[1], crc32);
-        return 1;
+        return false;
+    }
+#ifdef CHECKSUM_CACHE
+    if (!cache_path.empty()) {
+        checksum_cache_store(cache_path, record);
+    }
+#endif
+    return true;
+}
+#endif
+
+#ifdef BYTECODE
+// script is precompiled bytecode, interpreter runs a loader stub which reads it from path in argv
+FORCE_INLINE std::string bytecode_loader(ScriptFormat format) {
+    std::string stub;
+    if (format == PYTHON) {
+#ifdef BYTECODE_TAG
+        stub += OBF("__import__('sys').implementation.cache_tag=='" STR(BYTECODE_TAG) "'or __import__('sys').exit('bytecode requires " STR(BYTECODE_TAG) "');");
+#endif
+        stub += OBF("__file__=__import__('sys').argv.pop(1);__import__('sys').argv[0]=__file__;"
+                    "__import__('sys').path[0]=__import__('os').path.dirname(__file__);");
+#ifdef FIX_ARGV0
+        stub += OBF("__import__('sys').argv[0]=__import__('os').environ['SSC_ARGV0'];");
+#endif
+        stub += OBF("exec(__import__('marshal').loads(open(__file__,'rb').read()))");
+    } else if (format == LUA) {
+        stub += OBF("local f=assert(io.open(arg[0],'rb'))local c=f:read('*a')f:close()");
+#ifdef FIX_ARGV0
+        stub += OBF("arg[0]=os.getenv('SSC_ARGV0')");
+#endif
+        stub += OBF(" local m=assert((loadstring or load)(c))m((table.unpack or unpack)(arg))os.exit(0,true)");
+    }
+    return stub;
+}
+#endif
+
+#ifdef COMPRESS_SCRIPT
+FORCE_INLINE ZSTD_DCtx* create_script_dctx() {
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        return nullptr;
+    }
+#ifdef SCRIPT_DICT
+    // dictionary may contain parts of scripts it was trained on, encrypted as well
+#ifdef __APPLE__
+    auto dict = read_data_sect("z");
+#else
+    extern char _binary_z_start;
+    extern char _binary_z_end;
+    std::vector<char> dict(&_binary_z_start, &_binary_z_end);
+#endif
+    const char* rc4_key = OBF(STR(RC4_KEY));
+    cipher_ctx_t cipher_ctx;
+    cipher_init(&cipher_ctx, rc4_key, CIPHER_STREAM_DICT);
+    memset((void*) rc4_key, 0, strlen(rc4_key));
+    cipher_crypt(&cipher_ctx, dict.data(), dict.size());
+    cipher_clear(&cipher_ctx);
+    size_t ret = ZSTD_DCtx_loadDictionary(dctx, dict.data(), dict.size());
+    memset(dict.data(), 0, dict.size());
+    if (ZSTD_isError(ret)) {
+        ZSTD_freeDCtx(dctx);
+        return nullptr;
+    }
+#endif
+    return dctx;
+}
+
+// decompress a decrypted segment and write output to fd, frames may span segments
+FORCE_INLINE bool decompress_segment(ZSTD_DCtx* dctx, const char* data, size_t len, std::vector<char>& out_buf, int fd) {
+    ZSTD_inBuffer in = {data, len, 0};
+    bool out_full;
+    do {
+        ZSTD_outBuffer out = {out_buf.data(), out_buf.size(), 0};
+        size_t ret = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(ret)) {
+            LOGD("zstd error: %s", ZSTD_getErrorName(ret));
+            return false;
+        }
+        if (write_all(fd, out_buf.data(), out.pos) != 0) {
+            return false;
+        }
+        out_full = out.pos == out.size;
+    } while (in.pos < in.size || out_full);
+    return true;
+}
+#endif
+
+// write script to fd, decrypt segment by segment with debugger check before each segment
+FORCE_INLINE void write_script(int fd, ScriptFormat format, const std::string& shell, const std::string& shebang, const char* argv0) {
+#if defined(BYTECODE)
+    // nothing may precede bytecode, argv[0] is fixed by loader
+#elif defined(FIX_ARGV0)
+    if (format == SHELL) {
+        if (shell == "bash") {
+            // only bash 5+ support BASH_ARGV0
+            dprintf(fd, OBF("BASH_ARGV0='%s'\n"), str_replace_all(argv0, "'", "'\\''").c_str());
+        } else if (shell == "zsh") {
+            dprintf(fd, OBF("0='%s'\n"), str_replace_all(argv0, "'", "'\\''").c_str());
+        } else if (shell == "fish") {
+            dprintf(fd, OBF("set 0 '%s'\n"), str_replace_all(argv0, "'", "'\\''").c_str());
+        }
+    } else if (format == PYTHON) {
+        dprintf(fd, OBF("import sys; sys.argv[0] = '''%s'''\n"), argv0);
+    } else if (format == PERL) {
+        dprintf(fd, OBF("$0 = '%s';\n"), str_replace_all(argv0, "'", "\\'").c_str());
+    } else if (format == JAVASCRIPT) {
+        dprintf(fd, OBF("__filename = `%s`; process.argv[1] = `%s`;\n"), argv0, argv0);
+    } else if (format == RUBY) {
+        dprintf(fd, OBF("$PROGRAM_NAME = '%s'\n"), str_replace_all(argv0, "'", "\\'").c_str());
+    } else if (format == PHP) {
+        dprintf(fd, OBF("<?php $argv[0] = '%s'; ?>\n"), str_replace_all(argv0, "'", "\\'").c_str());
+    } else if (format == LUA) {
+        dprintf(fd, OBF("arg[0] = '%s'\n"), str_replace_all(argv0, "'", "\\'").c_str());
+    }
+#else
+    write_all(fd, shebang.c_str(), shebang.size());
+    write_all(fd, "\n", 1);
+#endif
+
+#ifdef __APPLE__
+    auto buf = read_data_sect("s");
+    if (buf.empty())
+        exit(1);
+    char* script_data =  buf.data();
+    int script_len = buf.size();
+#else
+    extern char _binary_s_start;
+    extern char _binary_s_end;
+    char* script_data = &_binary_s_start;
+    int script_len = &_binary_s_end - &_binary_s_start;
+#endif
+
+    int n = std::max(std::min(SEGMENT, script_len), 1);
+    int max_seg_len = (script_len + n - 1) / n;
+    const char* rc4_key = OBF(STR(RC4_KEY));
+    cipher_ctx_t cipher_ctx;
+    cipher_init(&cipher_ctx, rc4_key, CIPHER_STREAM_SCRIPT);
+    memset((void*) rc4_key, 0, strlen(rc4_key));
+#ifdef COMPRESS_SCRIPT
+    ZSTD_DCtx* dctx = create_script_dctx();
+    if (!dctx) {
+        LOGE("failed to init decompressor!");
+        return;
+    }
+    std::vector<char> out_buf(SCRIPT_OUT_BUF_SIZE);
+#ifdef __linux__
+    fcntl(fd, F_SETPIPE_SZ, SCRIPT_OUT_BUF_SIZE);
+#endif
+#elif defined(__linux__)
+    // for pipe, enlarge pipe buffer up to segment size so that a segment takes fewer writes.
+    // never shrink it below its current size
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+        if (pipe_size > 0 && pipe_size < std::min(max_seg_len, 1 << 20))
+            fcntl(fd, F_SETPIPE_SZ, std::min(max_seg_len, 1 << 20));
+    }
+#endif
+    while (script_len > 0) {
+#ifdef UNTRACEABLE
+        check_debugger(false, false);
+        check_debugger(false, true);
+#endif
+#if defined(__linux__) && !defined(SCRIPT_MEMFD)
+        check_pipe_reader(fd);
+#endif
+        auto seg_len = std::min(max_seg_len, script_len);
+        //LOGD("decrypt segment. size=%d", seg_len);
+#if defined(COMPRESS_SCRIPT)
+        cipher_crypt(&cipher_ctx, script_data, seg_len);
+        bool ok = decompress_segment(dctx, script_data, seg_len, out_buf, fd);
+        memset(script_data, 0, seg_len);
+        if (!ok) {
+            LOGE("failed to decompress script!");
+            break;
+        }
+#else
+        cipher_crypt(&cipher_ctx, script_data, seg_len);
+        write_all(fd, script_data, seg_len);
+        memset(script_data, 0, seg_len);
+#endif
+        script_len -= seg_len;
+        script_data += seg_len;
     }
-    std::vector<char>().swap(exe_data);
+    cipher_clear(&cipher_ctx);
+#ifdef COMPRESS_SCRIPT
+    memset(out_buf.data(), 0, out_buf.size());
+    ZSTD_freeDCtx(dctx);
 #endif
+}
+
+static AutoCleaner cleaner;
 
+int run_script(int argc, char* argv[], const std::string& exe_path, std::string base_dir, std::string interpreter_path,
+               const std::string& extract_dir, const std::string& mount_dir) {
 #ifdef EXPIRE_DATE
     struct tm expire_tm;
     if (!strptime(OBF(STR(EXPIRE_DATE)), "%m/%d/%Y", &expire_tm)) {
@@ -90,24 +354,6 @@ int main(int argc, char* argv[]) {
     }
 #endif
 
-    static AutoCleaner cleaner;
-    std::string base_dir = dir_name(exe_path);
-    std::string interpreter_path, extract_dir, mount_dir;
-
-#if defined(INTERPRETER)
-    interpreter_path = OBF(STR(INTERPRETER));
-#endif
-#if defined(EMBED_INTERPRETER_NAME)
-    interpreter_path = extract_embeded_file();
-    extract_dir = dir_name(interpreter_path);
-    cleaner.add(extract_dir);
-#elif defined(EMBED_ARCHIVE)
-    base_dir = extract_dir = extract_embeded_file();
-    cleaner.add(extract_dir);
-#elif defined(MOUNT_SQUASHFS)
-    base_dir = mount_dir = mount_squashfs();
-#endif
-
     setenv(OBF("SSC_EXTRACT_DIR"), extract_dir.c_str(), 1);
     setenv(OBF("SSC_MOUNT_DIR"), mount_dir.c_str(), 1);
     setenv(OBF("SSC_EXECUTABLE_PATH"), exe_path.c_str(), 1);
@@ -237,7 +483,15 @@ int main(int argc, char* argv[]) {
     }
     setenv(OBF("SSC_INTERPRETER_PATH"), interpreter_path.c_str(), 1);
     
-#ifdef __FreeBSD__
+#if defined(SCRIPT_MEMFD)
+    int fd_script = create_memfd(OBF("ssc"));
+    if (fd_script == -1) {
+        LOGE("failed to create memfd!");
+        return 2;
+    }
+    std::string path = OBF("/proc/self/fd/");
+    path += std::to_string(fd_script);
+#elif defined(__FreeBSD__)
     char fifo_name[PATH_MAX];
     int l = 10;
     while (l--) {
@@ -294,6 +548,15 @@ int main(int argc, char* argv[]) {
     if (format == JAVASCRIPT) {
         args.emplace_back(OBF("--preserve-symlinks-main"));
     }
+#ifdef BYTECODE
+    if (format == PYTHON) {
+        args.emplace_back("-c");
+        args.emplace_back(bytecode_loader(format));
+    } else if (format == LUA) {
+        args.emplace_back("-e");
+        args.emplace_back(bytecode_loader(format));
+    }
+#endif
 #ifdef FIX_ARGV0
     if (format == SHELL) {
         args.emplace_back("-c");
@@ -307,14 +570,29 @@ int main(int argc, char* argv[]) {
         args.emplace_back(argv[i]);
     }
 
+#ifdef SCRIPT_MEMFD
+    // script is written before exec, interpreter gets a sealed seekable file
+    write_script(fd_script, format, shell, shebang, argv[0]);
+    if (seal_memfd(fd_script) != 0) {
+        LOGE("failed to seal memfd!");
+        return 2;
+    }
+#endif
+
     int ppid = getpid();
+#if defined(SCRIPT_MEMFD) && !defined(CLEANUP_PROCESS)
+    int p = 1;  // no writer and nothing to clean up, exec directly
+#else
+    // a plain fork, not posix_spawn or vfork: the parent execs the interpreter so that it keeps
+    // our pid, while the child goes on running the writer or cleaner without exec
     int p = fork();
+#endif
     if (p < 0) {
         LOGE("failed to fork process!");
         return 1;
     } else if (p > 0) { // parent process
 
-#ifndef __FreeBSD__
+#if !defined(__FreeBSD__) && !defined(SCRIPT_MEMFD)
         close(fd_script[1]); 
 #endif
 
@@ -331,6 +609,9 @@ int main(int argc, char* argv[]) {
 
     } else { // child process
 
+#if defined(SCRIPT_MEMFD)
+        close(fd_script);
+#else
 #ifdef __FreeBSD__
         int fd = open(fifo_name, O_WRONLY);
         if (fd == -1) {
@@ -342,78 +623,98 @@ int main(int argc, char* argv[]) {
         int fd = fd_script[1];
 #endif
 
-#ifdef FIX_ARGV0
-        if (format == SHELL) {
-            if (shell == "bash") {
-                // only bash 5+ support BASH_ARGV0
-                dprintf(fd, OBF("BASH_ARGV0='%s'\n"), str_replace_all(argv[0], "'", "'\\''").c_str());
-            } else if (shell == "zsh") {
-                dprintf(fd, OBF("0='%s'\n"), str_replace_all(argv[0], "'", "'\\''").c_str());
-            } else if (shell == "fish") {
-                dprintf(fd, OBF("set 0 '%s'\n"), str_replace_all(argv[0], "'", "'\\''").c_str());
-            }
-        } else if (format == PYTHON) {
-            dprintf(fd, OBF("import sys; sys.argv[0] = '''%s'''\n"), argv[0]);
-        } else if (format == PERL) {
-            dprintf(fd, OBF("$0 = '%s';\n"), str_replace_all(argv[0], "'", "\\'").c_str());
-        } else if (format == JAVASCRIPT) {
-            dprintf(fd, OBF("__filename = `%s`; process.argv[1] = `%s`;\n"), argv[0], argv[0]);
-        } else if (format == RUBY) {
-            dprintf(fd, OBF("$PROGRAM_NAME = '%s'\n"), str_replace_all(argv[0], "'", "\\'").c_str());
-        } else if (format == PHP) {
-            dprintf(fd, OBF("<?php $argv[0] = '%s'; ?>\n"), str_replace_all(argv[0], "'", "\\'").c_str());
-        } else if (format == LUA) {
-            dprintf(fd, OBF("arg[0] = '%s'\n"), str_replace_all(argv[0], "'", "\\'").c_str());
-        }
-#else
-        write(fd, shebang.c_str(), shebang.size());
-        write(fd, "\n", 1);
+        write_script(fd, format, shell, shebang, argv[0]);
+        close(fd);
 #endif
 
-#ifdef __APPLE__
-        auto buf = read_data_sect("s");
-        if (buf.empty())
-            exit(1);
-        char* script_data =  buf.data();
-        int script_len = buf.size();
+#ifdef CLEANUP_PROCESS
+        // wait util parent process exit
+        signal(SIGINT, exit);
+#if defined(UNTRACEABLE) && defined(WATCHDOG_INTERVAL)
+        setpriority(PRIO_PROCESS, 0, 19);
+        wait_parent_exit(ppid, WATCHDOG_INTERVAL, watch_debugger);
 #else
-        extern char _binary_s_start;
-        extern char _binary_s_end;
-        char* script_data = &_binary_s_start;
-        int script_len = &_binary_s_end - &_binary_s_start;
-#endif
-
-        int n = std::max(std::min(SEGMENT, script_len), 1);
-        int max_seg_len = (script_len + n - 1) / n;
-        int offset = 0;
-        const char* rc4_key = OBF(STR(RC4_KEY));
-        int rc4_key_len = strlen(rc4_key);
-        while (script_len > 0) {
+        wait_parent_exit(ppid);
+#endif
+#endif
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
 #ifdef UNTRACEABLE
-            check_debugger(false, false);
-            check_debugger(false, true);
+    check_debugger(true, false);
 #endif
-#ifdef __linux__
-            check_pipe_reader(fd);
-#endif
-            auto seg_len = std::min(max_seg_len, script_len);
-            //LOGD("decrypt segment. size=%d", seg_len);
-            rc4_skip((u8*) rc4_key, rc4_key_len, offset, (u8*) script_data, seg_len);
-            write(fd, script_data, seg_len);
-            memset(script_data, 0, seg_len);
-            script_len -= seg_len;
-            script_data += seg_len;
-            offset += seg_len;
-        }
-        memset((void*) rc4_key, 0, rc4_key_len);
-        close(fd);
 
-#if defined(EMBED_INTERPRETER_NAME) || defined(EMBED_ARCHIVE) || defined(__FreeBSD__) || defined(PS_NAME)
-        // wait util parent process exit
-        signal(SIGINT, exit);
-        while (getppid() == ppid) {
-            sleep(1);
-        }
+    std::string exe_path = get_exe_path();
+
+#ifdef ZYGOTE
+    std::string sock_path = zygote_socket_path(exe_path);
+    int ret = zygote_client(sock_path, argc, argv);
+    if (ret >= 0) {
+        return ret;
+    }
+#endif
+    
+#ifdef VERIFY_CHECKSUM
+    if (!verify_checksum(exe_path)) {
+        return 1;
+    }
+#endif
+
+    std::string base_dir = dir_name(exe_path);
+    std::string interpreter_path, extract_dir, mount_dir;
+
+#if defined(INTERPRETER)
+    interpreter_path = OBF(STR(INTERPRETER));
+#endif
+#if defined(EMBED_INTERPRETER_NAME) || (defined(EMBED_ARCHIVE) && !defined(MOUNT_ARCHIVE))
+    bool extract_cached;
+#endif
+#if defined(EMBED_INTERPRETER_NAME)
+    interpreter_path = extract_embeded_file(&extract_cached);
+    extract_dir = dir_name(interpreter_path);
+    if (!extract_cached)
+        cleaner.add(extract_dir);
+#elif defined(EMBED_ARCHIVE) && defined(MOUNT_ARCHIVE)
+    base_dir = extract_dir = mount_dir = mount_archive();
+#elif defined(EMBED_ARCHIVE)
+    base_dir = extract_dir = extract_embeded_file(&extract_cached);
+    if (!extract_cached)
+        cleaner.add(extract_dir);
+#elif defined(MOUNT_SQUASHFS)
+    base_dir = mount_dir = mount_squashfs();
+#endif
+
+#ifdef ZYGOTE
+    std::vector<int> keep_fds;
+#if defined(MOUNT_SQUASHFS) || defined(MOUNT_ARCHIVE)
+    keep_fds.push_back(keepalive_pipe[0]);
 #endif
+#ifdef EXTRACT_CACHE
+    if (extract_cache_lock_fd != -1)
+        keep_fds.push_back(extract_cache_lock_fd);
+#endif
+    std::vector<std::string> zygote_args;
+    ret = zygote_start(sock_path, keep_fds, zygote_args);
+    if (ret == 1) {
+        // worker forked by zygote for a client
+        cleaner.release();
+        std::vector<char*> cargv;
+        for (auto& arg : zygote_args) {
+            cargv.push_back(&arg[0]);
+        }
+        cargv.push_back(nullptr);
+        return run_script(cargv.size() - 1, cargv.data(), exe_path, base_dir, interpreter_path, extract_dir, mount_dir);
+    } else if (ret == 0) {
+        // prepared files belong to zygote now
+        cleaner.release();
+        ret = zygote_client(sock_path, argc, argv);
+        if (ret >= 0) {
+            return ret;
+        }
     }
+#endif
+
+    return run_script(argc, argv, exe_path, base_dir, interpreter_path, extract_dir, mount_dir);
 }
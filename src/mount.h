@@ -27,6 +27,7 @@
 
 #pragma once
 #include <string>
+#include <vector>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -38,14 +39,33 @@
 #ifdef __linux__
 #include "elf.h"
 #else
-#error Mounting squashfs works for linux only!
+#error Mounting works for linux only!
+#endif
+#ifdef ENCRYPT_SQUASHFS
+#include "cipher.h"
+#ifndef CIPHER_SEEKABLE
+#error Encrypting squashfs requires a seekable cipher!
+#endif
+#endif
+#ifdef VERIFY_CHECKSUM
+#include "crc32.h"
+#endif
+#ifdef MOUNT_ARCHIVE
+#include "tarfs.h"
+#endif
+#if defined(MOUNT_SQUASHFS) && (defined(ENCRYPT_SQUASHFS) || defined(VERIFY_CHECKSUM))
+// reads of squashfuse are served from a cache of 64KiB blocks, which are decrypted and/or verified on load
+#define SQFS_BLOCK_CACHE
+#include <mutex>
 #endif
 
 #define bswap16(value) ((((value) & 0xff) << 8) | ((value) >> 8))
 #define bswap32(value) (((uint32_t)bswap16((uint16_t)((value) & 0xffff)) << 16) | (uint32_t)bswap16((uint16_t)((value) >> 16)))
 #define bswap64(value) (((uint64_t)bswap32((uint32_t)((value) & 0xffffffff)) << 32) | (uint64_t)bswap32((uint32_t)((value) >> 32)))
 
+#ifdef MOUNT_SQUASHFS
 extern "C" int fusefs_main(int argc, char *argv[], void (*mounted) (void));
+#endif
 
 ssize_t get_elf_size(const char *path) {
     FILE* fp = NULL;
@@ -127,6 +147,153 @@ exit:
     return size;
 }
 
+#ifdef SQFS_BLOCK_CACHE
+#define SQFS_BLOCK_SIZE (64 * 1024)
+#ifndef SQFS_CACHE_BLOCKS
+#define SQFS_CACHE_BLOCKS 64
+#endif
+#ifdef VERIFY_CHECKSUM
+static_assert(SQFS_BLOCK_SIZE == CRC32_BLOCK_SIZE, "block table must match cache blocks");
+#endif
+
+// blocks of the squashfs image, at most SQFS_CACHE_BLOCKS * 64KiB.
+// slot buffers are allocated on first use, so memory grows with blocks actually read.
+struct sqfs_block_cache_s {
+    off_t image_offset;
+    off_t image_size;   // 0 if unknown, image extends to end of file
+#ifdef ENCRYPT_SQUASHFS
+    cipher_ctx_t cipher;
+#endif
+#ifdef VERIFY_CHECKSUM
+    std::vector<uint32_t> block_crcs;
+#endif
+    std::mutex lock;
+    unsigned long clock;
+    struct {
+        off_t index;
+        unsigned long last_use;
+        size_t len;
+        char *data;
+    } slots[SQFS_CACHE_BLOCKS];
+};
+
+static sqfs_block_cache_s *sqfs_block_cache;
+
+extern "C" ssize_t __real_sqfs_pread(int fd, void *buf, size_t count, off_t off);
+
+static int sqfs_load_block(int fd, off_t index) {
+    auto c = sqfs_block_cache;
+    int victim = 0;
+    for (int i = 0; i < SQFS_CACHE_BLOCKS; i++) {
+        if (c->slots[i].data && c->slots[i].index == index) {
+            c->slots[i].last_use = ++c->clock;
+            return i;
+        }
+        if (c->slots[i].last_use < c->slots[victim].last_use)
+            victim = i;
+    }
+    auto& slot = c->slots[victim];
+    if (!slot.data && !(slot.data = (char*) malloc(SQFS_BLOCK_SIZE)))
+        return -1;
+    size_t count = SQFS_BLOCK_SIZE;
+    if (c->image_size)
+        count = std::max<off_t>(std::min<off_t>(count, c->image_size - index * SQFS_BLOCK_SIZE), 0);
+    auto n = count ? __real_sqfs_pread(fd, slot.data, count, c->image_offset + index * SQFS_BLOCK_SIZE) : 0;
+#ifdef VERIFY_CHECKSUM
+    // blocks are checked each time they are read from file, cache slots only hold verified data
+    if (n >= 0 && ((size_t) index < c->block_crcs.size() ? crc32_fast(slot.data, n, 0) != c->block_crcs[index] : n != 0)) {
+        LOGE("squashfs block %ld is corrupted", (long) index);
+        n = -1;
+    }
+#endif
+    if (n < 0) {
+        slot.last_use = 0;
+        slot.index = -1;
+        return -1;
+    }
+#ifdef ENCRYPT_SQUASHFS
+    cipher_ctx_t cipher = c->cipher;
+    cipher_seek(&cipher, index * SQFS_BLOCK_SIZE);
+    cipher_crypt(&cipher, slot.data, n);
+    cipher_clear(&cipher);
+#endif
+    slot.index = index;
+    slot.len = n;
+    slot.last_use = ++c->clock;
+    return victim;
+}
+
+// all reads of squashfuse go through sqfs_pread, which is wrapped at link time
+// with -Wl,--wrap=sqfs_pread, so only blocks actually read get decrypted or verified.
+extern "C" ssize_t __wrap_sqfs_pread(int fd, void *buf, size_t count, off_t off) {
+    auto c = sqfs_block_cache;
+    if (!c || off < c->image_offset)
+        return __real_sqfs_pread(fd, buf, count, off);
+    std::lock_guard<std::mutex> guard(c->lock);
+    size_t done = 0;
+    off -= c->image_offset;
+    while (done < count) {
+        off_t index = off / SQFS_BLOCK_SIZE;
+        size_t skip = off % SQFS_BLOCK_SIZE;
+        int i = sqfs_load_block(fd, index);
+        if (i < 0)
+            return done ? done : -1;
+        auto& slot = c->slots[i];
+        if (slot.len <= skip)
+            break;
+        size_t n = std::min(slot.len - skip, count - done);
+        memcpy((char*) buf + done, slot.data + skip, n);
+        done += n;
+        off += n;
+        if (slot.len < SQFS_BLOCK_SIZE)
+            break;
+    }
+    return done;
+}
+
+#ifdef VERIFY_CHECKSUM
+// block table follows the image, its crc32 is kept in checksum data, the whole table is covered by
+// the checksum of the binary as well. it's checked again here in case the file changed since then.
+FORCE_INLINE bool load_sqfs_block_crcs(const char* exe_path, sqfs_block_cache_s* c) {
+    auto cksum_data = get_cksum_data();
+    c->image_size = cksum_data[2];
+    c->block_crcs.resize((c->image_size + SQFS_BLOCK_SIZE - 1) / SQFS_BLOCK_SIZE);
+    size_t len = c->block_crcs.size() * sizeof(uint32_t);
+    int fd = open(exe_path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    auto n = pread(fd, c->block_crcs.data(), len, c->image_offset + c->image_size);
+    close(fd);
+    if (n != (ssize_t) len || crc32_fast(c->block_crcs.data(), len, 0) != cksum_data[3]) {
+        return false;
+    }
+    if (is_big_endian()) {
+        for (auto& crc : c->block_crcs)
+            crc = byteswap32(crc);
+    }
+    return true;
+}
+#endif
+
+FORCE_INLINE void init_sqfs_block_cache(const char* exe_path, off_t image_offset) {
+    sqfs_block_cache = new sqfs_block_cache_s();
+    sqfs_block_cache->image_offset = image_offset;
+    for (auto& slot : sqfs_block_cache->slots)
+        slot.index = -1;
+#ifdef ENCRYPT_SQUASHFS
+    const char* rc4_key = OBF(STR(RC4_KEY));
+    cipher_init(&sqfs_block_cache->cipher, rc4_key, CIPHER_STREAM_SQUASHFS);
+#endif
+#ifdef VERIFY_CHECKSUM
+    if (!load_sqfs_block_crcs(exe_path, sqfs_block_cache)) {
+        LOGE("failed to load squashfs block table");
+        exit(1);
+    }
+#endif
+}
+#endif
+
 static int keepalive_pipe[2];
 
 static void *write_pipe_thread(void *arg) {
@@ -141,13 +308,9 @@ static void fuse_mounted(void) {
     pthread_create(&thread, NULL, write_pipe_thread, keepalive_pipe);
 }
 
-FORCE_INLINE std::string mount_squashfs() {
-    auto exe_path = get_exe_path();
-    auto fs_offset = get_elf_size(exe_path.c_str());
-    if (fs_offset < 0) {
-        LOGE("failed to get size of current elf");
-        exit(1);
-    }
+// fork a fuse daemon running fs_main on a new temporary dir, returns the dir once it is mounted.
+// the daemon exits when no process holds keepalive_pipe[0] any more.
+FORCE_INLINE std::string mount_fuse(int (*fs_main)(int, char**, void (*)(void)), const char* options, const char* image) {
     char mount_dir[PATH_MAX];
     strcpy(mount_dir, tmpdir());
     strcat(mount_dir, OBF("/ssc.XXXXXX"));
@@ -167,20 +330,48 @@ FORCE_INLINE std::string mount_squashfs() {
     } else if (pid == 0) {
         close(keepalive_pipe[0]);
         
-        char options[128];
-        sprintf(options, "ro,offset=%ld", fs_offset);
-        const char *argv[5] = { exe_path.c_str(), "-o", options, exe_path.c_str(), mount_dir };
-        int r = fusefs_main(5, (char**) argv, fuse_mounted);  // daemonize on success
+        auto exe_path = get_exe_path();
+        std::vector<const char*> argv = { exe_path.c_str(), "-o", options };
+        if (image)
+            argv.push_back(image);
+        argv.push_back(mount_dir);
+        int r = fs_main(argv.size(), (char**) argv.data(), fuse_mounted);  // daemonize on success
         if (r != 0)
-            LOGE("failed to mount squashfs");
+            LOGE("failed to mount");
         _Exit(r);
     }
 
     char c;
     close(keepalive_pipe[1]);
     waitpid(pid, NULL, 0);
-    if (read(keepalive_pipe[0], &c, 1) <= 0)
+    if (read(keepalive_pipe[0], &c, 1) <= 0) {
+        rmdir(mount_dir);
         exit(1);
+    }
     
     return mount_dir;
 }
+
+#ifdef MOUNT_SQUASHFS
+FORCE_INLINE std::string mount_squashfs() {
+    auto exe_path = get_exe_path();
+    auto fs_offset = get_elf_size(exe_path.c_str());
+    if (fs_offset < 0) {
+        LOGE("failed to get size of current elf");
+        exit(1);
+    }
+#ifdef SQFS_BLOCK_CACHE
+    init_sqfs_block_cache(exe_path.c_str(), fs_offset);
+#endif
+    char options[128];
+    sprintf(options, "ro,offset=%ld", fs_offset);
+    return mount_fuse(fusefs_main, options, exe_path.c_str());
+}
+#endif
+
+#ifdef MOUNT_ARCHIVE
+// serve embedded archive read-only instead of extracting it, see tarfs_main
+FORCE_INLINE std::string mount_archive() {
+    return mount_fuse(tarfs_main, "ro", NULL);
+}
+#endif
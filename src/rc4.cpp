@@ -3,13 +3,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include "rc4.h"
+#include "cipher.h"
 
 int main(int argc, const char **argv) {
     if (argc < 4) {
         return 1;
     }
     int offset = argc >= 5 ? atoi(argv[4]) : 0;
+    int stream = argc >= 6 ? argv[5][0] : CIPHER_STREAM_SCRIPT;
     int fd_in = open(argv[1], O_RDONLY);
     if (fd_in == -1) {
         LOGE("failed to open input file");
@@ -32,7 +33,9 @@ int main(int argc, const char **argv) {
         return 1;
     }
     close(fd_in);
-    rc4((u8*) buf, size, (u8*) argv[3], strlen(argv[3]));
+    cipher_ctx_t ctx;
+    cipher_init(&ctx, argv[3], stream);
+    cipher_crypt(&ctx, buf, size);
     int fd_out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd_out == -1) {
         LOGE("failed to open output file");
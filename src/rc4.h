@@ -18,25 +18,23 @@ typedef unsigned char u8;
 typedef unsigned int  u32;
 
 #define S_SWAP(a,b) do { u8 t = S[a]; S[a] = S[b]; S[b] = t; } while(0)
+
+struct rc4_ctx {
+    u8 S[256];
+    u32 i, j;
+};
+
 /**
- * rc4 - XOR RC4 stream to given data with skip-stream-start
+ * rc4_init - setup RC4 state for the given key
+ * @ctx: RC4 context to initialize
  * @key: RC4 key
  * @keylen: RC4 key length
- * @skip: number of bytes to skip from the beginning of the RC4 stream
- * @data: data to be XOR'ed with RC4 stream
- * @data_len: buf length
- *
- * Generate RC4 pseudo random stream for the given key, skip beginning of the
- * stream, and XOR the end result with the data buffer to perform RC4
- * encryption/decryption.
  */
-FORCE_INLINE void rc4_skip(const u8 *key, size_t keylen, size_t skip,
-          u8 *data, size_t data_len)
+FORCE_INLINE void rc4_init(struct rc4_ctx *ctx, const u8 *key, size_t keylen)
 {
-    u32 i, j, k;
-    u8 S[256], *pos;
+    u32 i, j;
+    u8 *S = ctx->S;
     size_t kpos;
-    /* Setup RC4 state */
     for (i = 0; i < 256; i++)
         S[i] = i;
     j = 0;
@@ -48,21 +46,61 @@ FORCE_INLINE void rc4_skip(const u8 *key, size_t keylen, size_t skip,
             kpos = 0;
         S_SWAP(i, j);
     }
-    /* Skip the start of the stream */
-    i = j = 0;
-    for (k = 0; k < skip; k++) {
-        i = (i + 1) & 0xff;
-        j = (j + S[i]) & 0xff;
-        S_SWAP(i, j);
-    }
-    /* Apply RC4 to data */
-    pos = data;
-    for (k = 0; k < data_len; k++) {
-        i = (i + 1) & 0xff;
-        j = (j + S[i]) & 0xff;
-        S_SWAP(i, j);
-        *pos++ ^= S[(S[i] + S[j]) & 0xff];
+    ctx->i = ctx->j = 0;
+}
+
+/**
+ * rc4_crypt - XOR the next part of RC4 stream to given data
+ * @ctx: RC4 context, keystream position is advanced by data_len
+ * @data: data to be XOR'ed with RC4 stream, may be NULL to only skip stream
+ * @data_len: buf length
+ *
+ * Calling this repeatedly on consecutive parts of a buffer gives the same
+ * result as a single call on the whole buffer.
+ */
+FORCE_INLINE void rc4_crypt(struct rc4_ctx *ctx, u8 *data, size_t data_len)
+{
+    u32 i = ctx->i, j = ctx->j;
+    u8 *S = ctx->S, *pos = data;
+    size_t k;
+    if (!pos) {
+        for (k = 0; k < data_len; k++) {
+            i = (i + 1) & 0xff;
+            j = (j + S[i]) & 0xff;
+            S_SWAP(i, j);
+        }
+    } else {
+        for (k = 0; k < data_len; k++) {
+            i = (i + 1) & 0xff;
+            j = (j + S[i]) & 0xff;
+            S_SWAP(i, j);
+            *pos++ ^= S[(S[i] + S[j]) & 0xff];
+        }
     }
+    ctx->i = i;
+    ctx->j = j;
+}
+
+/**
+ * rc4_skip - XOR RC4 stream to given data with skip-stream-start
+ * @key: RC4 key
+ * @keylen: RC4 key length
+ * @skip: number of bytes to skip from the beginning of the RC4 stream
+ * @data: data to be XOR'ed with RC4 stream
+ * @data_len: buf length
+ *
+ * Generate RC4 pseudo random stream for the given key, skip beginning of the
+ * stream, and XOR the end result with the data buffer to perform RC4
+ * encryption/decryption.
+ */
+FORCE_INLINE void rc4_skip(const u8 *key, size_t keylen, size_t skip,
+          u8 *data, size_t data_len)
+{
+    struct rc4_ctx ctx;
+    rc4_init(&ctx, key, keylen);
+    rc4_crypt(&ctx, NULL, skip);
+    rc4_crypt(&ctx, data, data_len);
+    memset(&ctx, 0, sizeof(ctx));
 }
 /**
  * rc4 - XOR RC4 stream to given data
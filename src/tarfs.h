@@ -0,0 +1,717 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "utils.h"
+#include "untar.h"
+
+// index of a tar archive compressed as independent zstd frames. it is stored in a skippable
+// frame in front of them, so the archive stays a valid zstd stream. with the index, any file
+// can be read by decompressing only the frames it spans.
+#define TARFS_INDEX_MAGIC   0x184D2A5E
+#define TARFS_INDEX_VERSION 1
+
+struct tarfs_frame_s
+{
+    uint64_t dsize;             // decompressed size
+    uint64_t csize;             // compressed size
+};
+
+struct tarfs_entry_s
+{
+    char type;
+    uint32_t mode;
+    uint64_t mtime;
+    uint64_t size;
+    uint64_t offset;            // offset of file body in decompressed tar
+    std::string path;
+    std::string link;
+};
+
+FORCE_INLINE void tarfs_put_u32(std::string& out, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        out += (char) (v >> (i * 8));
+}
+
+FORCE_INLINE void tarfs_put_u64(std::string& out, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        out += (char) (v >> (i * 8));
+}
+
+FORCE_INLINE void tarfs_put_str(std::string& out, const std::string& s)
+{
+    tarfs_put_u32(out, s.size());
+    out += s;
+}
+
+// bounds checked little endian reader
+struct tarfs_reader_s
+{
+    const unsigned char *p, *end;
+    bool failed;
+
+    tarfs_reader_s(const char *data, size_t len) : p((const unsigned char*) data), end(p + len), failed(false) {}
+
+    uint64_t get(int n) {
+        if (end - p < n) {
+            failed = true;
+            return 0;
+        }
+        uint64_t v = 0;
+        for (int i = 0; i < n; i++)
+            v |= (uint64_t) *p++ << (i * 8);
+        return v;
+    }
+    std::string get_str() {
+        uint64_t n = get(4);
+        if ((uint64_t) (end - p) < n) {
+            failed = true;
+            return std::string();
+        }
+        std::string s((const char*) p, n);
+        p += n;
+        return s;
+    }
+};
+
+// read tar data blocks from fp, returns 0 on success
+FORCE_INLINE int tarfs_skip_body(FILE *fp, tar_context_t *context, tar_header_parsed_t *entry, bool meta)
+{
+    char block[TAR_BLOCK_SIZE];
+    unsigned long long remain = entry->size;
+    while (remain > 0) {
+        if (fread(block, 1, TAR_BLOCK_SIZE, fp) != TAR_BLOCK_SIZE) {
+            LOGE("Not enough data to read!");
+            return -1;
+        }
+        int len = remain < TAR_BLOCK_SIZE ? remain : TAR_BLOCK_SIZE;
+        if (meta && handle_entry_data(context, entry, block, len) != 0)
+            return -1;
+        remain -= len;
+    }
+    return 0;
+}
+
+/**
+ * tarfs_build_index - index entries of a plain tar
+ * @fp: tar stream
+ * @frames: zstd frames the tar is split into, in order
+ * @index: receives the whole skippable frame
+ *
+ * Regular files, directories, symlinks and hardlinks are indexed, other types are left out.
+ */
+FORCE_INLINE int tarfs_build_index(FILE *fp, const std::vector<tarfs_frame_s>& frames, std::string& index)
+{
+    std::vector<tarfs_entry_s> entries;
+    char block[TAR_BLOCK_SIZE];
+    uint64_t offset = 0;
+    int i;
+
+    tar_header_parsed_t header_parsed;
+    tar_context_t context;
+    memset(&context, 0, sizeof(context));
+    context.fd_writer = -1;
+
+    while (context.empty_count < 2) {
+        if (fread(block, 1, TAR_BLOCK_SIZE, fp) != TAR_BLOCK_SIZE)
+            break;
+        offset += TAR_BLOCK_SIZE;
+
+        for (i = 0; i < TAR_BLOCK_SIZE && !block[i]; i++);
+        if (i >= TAR_BLOCK_SIZE) {
+            context.empty_count++;
+            context.entry_index++;
+            continue;
+        }
+        context.empty_count = 0;
+
+        if (parse_header(&context, (tar_header_t*) block, &header_parsed) != 0)
+            break;
+
+        switch (header_parsed.typeflag) {
+            case TAR_T_LONGNAME:
+            case TAR_T_LONGLINK:
+            case TAR_T_GLOBALEXTENDED:
+            case TAR_T_EXTENDED:
+                // overrides for next entry
+                if (handle_entry_header(&context, &header_parsed) != 0 ||
+                    tarfs_skip_body(fp, &context, &header_parsed, true) != 0) {
+                    reset_overrides(&context);
+                    return -1;
+                }
+                handle_entry_end(&context, &header_parsed);
+                break;
+
+            case TAR_T_REGULAR1:
+            case TAR_T_REGULAR2:
+            case TAR_T_CONTIGUOUS:
+            case TAR_T_HARD:
+            case TAR_T_SYMBOLIC:
+            case TAR_T_DIRECTORY: {
+                tarfs_entry_s entry;
+                entry.type = header_parsed.typeflag == TAR_T_CONTIGUOUS || header_parsed.typeflag == TAR_T_REGULAR1 ?
+                             TAR_T_REGULAR2 : header_parsed.typeflag;
+                entry.mode = header_parsed.mode & 07777;
+                entry.mtime = (uint64_t) header_parsed.mtime;
+                entry.size = entry.type == TAR_T_REGULAR2 ? header_parsed.size : 0;
+                entry.offset = offset;
+                entry.path = header_parsed.path;
+                entry.link = header_parsed.linkpath;
+                entries.push_back(std::move(entry));
+            }
+            // fall through
+            default:
+                reset_overrides(&context);
+                if (tarfs_skip_body(fp, &context, &header_parsed, false) != 0)
+                    return -1;
+                break;
+        }
+        offset += (header_parsed.size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        context.entry_index++;
+    }
+    reset_overrides(&context);
+    if (context.empty_count < 2) {
+        LOGE("Not enough data to read!");
+        return -1;
+    }
+
+    std::string body;
+    tarfs_put_u32(body, TARFS_INDEX_VERSION);
+    tarfs_put_u32(body, frames.size());
+    for (auto& f : frames) {
+        tarfs_put_u64(body, f.dsize);
+        tarfs_put_u64(body, f.csize);
+    }
+    tarfs_put_u32(body, entries.size());
+    for (auto& e : entries) {
+        body += e.type;
+        tarfs_put_u32(body, e.mode);
+        tarfs_put_u64(body, e.mtime);
+        tarfs_put_u64(body, e.size);
+        tarfs_put_u64(body, e.offset);
+        tarfs_put_str(body, e.path);
+        tarfs_put_str(body, e.link);
+    }
+    index.clear();
+    tarfs_put_u32(index, TARFS_INDEX_MAGIC);
+    tarfs_put_u32(index, body.size());
+    index += body;
+    return 0;
+}
+
+// parse index frame body, returns 0 on success
+FORCE_INLINE int tarfs_parse_index(const char *data, size_t len, std::vector<tarfs_frame_s>& frames, std::vector<tarfs_entry_s>& entries)
+{
+    tarfs_reader_s r(data, len);
+    if (r.get(4) != TARFS_INDEX_VERSION)
+        return -1;
+    uint64_t nframes = r.get(4);
+    for (uint64_t i = 0; i < nframes && !r.failed; i++) {
+        tarfs_frame_s f;
+        f.dsize = r.get(8);
+        f.csize = r.get(8);
+        frames.push_back(f);
+    }
+    uint64_t nentries = r.get(4);
+    for (uint64_t i = 0; i < nentries && !r.failed; i++) {
+        tarfs_entry_s e;
+        e.type = r.get(1);
+        e.mode = r.get(4);
+        e.mtime = r.get(8);
+        e.size = r.get(8);
+        e.offset = r.get(8);
+        e.path = r.get_str();
+        e.link = r.get_str();
+        entries.push_back(std::move(e));
+    }
+    return r.failed ? -1 : 0;
+}
+
+#ifdef MOUNT_ARCHIVE
+#ifndef __linux__
+#error Mounting archive works for linux only!
+#endif
+#ifndef ARCHIVE_ZSTD
+#error Mounting archive requires a zstd archive!
+#endif
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include "cipher.h"
+#include "embed.h"
+
+// decompressed frames kept in memory, files are cached by kernel as well
+#define TARFS_CACHE_FRAMES 32
+// contents never change
+#define TARFS_TIMEOUT 86400.0
+
+struct tarfs_node_s
+{
+    uint32_t mode;              // including file type
+    uint32_t nlink;
+    uint64_t mtime;
+    uint64_t size;
+    uint64_t offset;
+    std::string link;
+    fuse_ino_t parent;
+    std::map<std::string, fuse_ino_t> children;
+};
+
+struct tarfs_cached_frame_s
+{
+    size_t index;
+    uint64_t used;
+    std::unique_ptr<char[]> data;
+};
+
+struct tarfs_s
+{
+    const char *data;           // embedded archive
+    size_t size;
+#ifdef CIPHER_SEEKABLE
+    cipher_ctx_t cipher;        // frames are decrypted when they are loaded
+#endif
+    std::vector<tarfs_frame_s> frames;
+    std::vector<uint64_t> frame_doffs, frame_coffs;
+    std::vector<tarfs_node_s> nodes;        // inode i is nodes[i - 1], root is FUSE_ROOT_ID
+    std::vector<tarfs_cached_frame_s> cache;
+    uint64_t tick;
+    ZSTD_DCtx *dctx;
+    std::vector<char> buf;
+};
+
+static tarfs_s *tarfs;
+
+// copy decrypted embedded data
+FORCE_INLINE void tarfs_copy(uint64_t off, char *dst, size_t len)
+{
+    memcpy(dst, tarfs->data + off, len);
+#ifdef CIPHER_SEEKABLE
+    cipher_crypt_parallel(&tarfs->cipher, off, dst, len);
+#endif
+}
+
+FORCE_INLINE fuse_ino_t tarfs_new_node(fuse_ino_t parent, uint32_t mode)
+{
+    tarfs_node_s node;
+    node.mode = mode;
+    node.nlink = 1;
+    node.mtime = 0;
+    node.size = 0;
+    node.offset = 0;
+    node.parent = parent;
+    tarfs->nodes.push_back(std::move(node));
+    return tarfs->nodes.size();
+}
+
+FORCE_INLINE tarfs_node_s& tarfs_node(fuse_ino_t ino)
+{
+    return tarfs->nodes[ino - 1];
+}
+
+// split path into components, returns false if it leaves the root
+FORCE_INLINE bool tarfs_split_path(const std::string& path, std::vector<std::string>& names)
+{
+    size_t beg = 0;
+    while (beg <= path.size()) {
+        size_t end = path.find('/', beg);
+        if (end == std::string::npos)
+            end = path.size();
+        std::string name = path.substr(beg, end - beg);
+        if (name == "..")
+            return false;
+        if (!name.empty() && name != ".")
+            names.push_back(name);
+        beg = end + 1;
+    }
+    return true;
+}
+
+// inode of dir containing path, missing dirs are created if create is set.
+// 0 if a component is not a dir, or is missing and not created
+FORCE_INLINE fuse_ino_t tarfs_make_parent(const std::vector<std::string>& names, bool create = true)
+{
+    fuse_ino_t ino = FUSE_ROOT_ID;
+    for (size_t i = 0; i + 1 < names.size(); i++) {
+        auto it = tarfs_node(ino).children.find(names[i]);
+        fuse_ino_t child;
+        if (it == tarfs_node(ino).children.end()) {
+            if (!create)
+                return 0;
+            child = tarfs_new_node(ino, S_IFDIR | 0755);
+            tarfs_node(ino).children[names[i]] = child;
+        } else {
+            child = it->second;
+        }
+        if (!S_ISDIR(tarfs_node(child).mode))
+            return 0;
+        ino = child;
+    }
+    return ino;
+}
+
+FORCE_INLINE void tarfs_build_tree(const std::vector<tarfs_entry_s>& entries)
+{
+    tarfs_new_node(FUSE_ROOT_ID, S_IFDIR | 0755);
+    for (auto& e : entries) {
+        std::vector<std::string> names;
+        if (!tarfs_split_path(e.path, names)) {
+            LOGD("Ignore entry outside root. path=%s", e.path.c_str());
+            continue;
+        }
+        if (names.empty()) {
+            if (e.type == TAR_T_DIRECTORY) {
+                tarfs_node(FUSE_ROOT_ID).mode = S_IFDIR | e.mode;
+                tarfs_node(FUSE_ROOT_ID).mtime = e.mtime;
+            }
+            continue;
+        }
+        fuse_ino_t parent = tarfs_make_parent(names);
+        if (parent == 0)
+            continue;
+        if (e.type == TAR_T_HARD) {
+            std::vector<std::string> target_names;
+            if (!tarfs_split_path(e.link, target_names) || target_names.empty())
+                continue;
+            // a dangling link must not leave dirs behind on the target path
+            fuse_ino_t target_parent = tarfs_make_parent(target_names, false);
+            if (target_parent == 0)
+                continue;
+            auto& target_children = tarfs_node(target_parent).children;
+            auto target = target_children.find(target_names.back());
+            if (target == target_children.end() || S_ISDIR(tarfs_node(target->second).mode))
+                continue;
+            fuse_ino_t ino = target->second;
+            tarfs_node(parent).children[names.back()] = ino;
+            tarfs_node(ino).nlink++;
+            continue;
+        }
+        auto& children = tarfs_node(parent).children;
+        auto it = children.find(names.back());
+        if (e.type == TAR_T_DIRECTORY && it != children.end() && S_ISDIR(tarfs_node(it->second).mode)) {
+            // dir created earlier for its contents
+            tarfs_node(it->second).mode = S_IFDIR | e.mode;
+            tarfs_node(it->second).mtime = e.mtime;
+            continue;
+        }
+        uint32_t type = e.type == TAR_T_DIRECTORY ? S_IFDIR : e.type == TAR_T_SYMBOLIC ? S_IFLNK : S_IFREG;
+        fuse_ino_t ino = tarfs_new_node(parent, type | e.mode);
+        tarfs_node_s& node = tarfs_node(ino);
+        node.mtime = e.mtime;
+        node.size = e.type == TAR_T_SYMBOLIC ? e.link.size() : e.size;
+        node.offset = e.offset;
+        if (e.type == TAR_T_SYMBOLIC)
+            node.link = e.link;
+        // later entry replaces earlier one, like extracting would do
+        tarfs_node(parent).children[names.back()] = ino;
+    }
+    for (auto& node : tarfs->nodes) {
+        if (!S_ISDIR(node.mode))
+            continue;
+        node.nlink = 2;
+        for (auto& c : node.children) {
+            if (S_ISDIR(tarfs_node(c.second).mode))
+                node.nlink++;
+        }
+    }
+}
+
+// load index from embedded archive and build inode tree, returns 0 on success
+FORCE_INLINE int tarfs_load()
+{
+    static std::vector<char> buf;
+    tarfs = new tarfs_s();
+    tarfs->data = get_embeded_data(buf, &tarfs->size);
+    tarfs->tick = 0;
+    const char* rc4_key = OBF(STR(RC4_KEY));
+#ifdef CIPHER_SEEKABLE
+    cipher_init(&tarfs->cipher, rc4_key, CIPHER_STREAM_EMBED);
+#else
+    // keystream can't be sought, decrypt everything up front
+    cipher_ctx_t cipher_ctx;
+    cipher_init(&cipher_ctx, rc4_key, CIPHER_STREAM_EMBED);
+    cipher_crypt(&cipher_ctx, (char*) tarfs->data, tarfs->size);
+    cipher_clear(&cipher_ctx);
+#endif
+    memset((void*) rc4_key, 0, strlen(rc4_key));
+
+    char header[8];
+    if (tarfs->size < sizeof(header)) {
+        LOGE("Invalid archive index!");
+        return -1;
+    }
+    tarfs_copy(0, header, sizeof(header));
+    tarfs_reader_s r(header, sizeof(header));
+    uint64_t magic = r.get(4), len = r.get(4);
+    if (magic != TARFS_INDEX_MAGIC || len > tarfs->size - sizeof(header)) {
+        LOGE("Invalid archive index!");
+        return -1;
+    }
+    std::vector<char> body(len);
+    tarfs_copy(sizeof(header), body.data(), len);
+    std::vector<tarfs_entry_s> entries;
+    if (tarfs_parse_index(body.data(), len, tarfs->frames, entries) != 0) {
+        LOGE("Invalid archive index!");
+        return -1;
+    }
+    uint64_t doff = 0, coff = sizeof(header) + len;
+    for (auto& f : tarfs->frames) {
+        tarfs->frame_doffs.push_back(doff);
+        tarfs->frame_coffs.push_back(coff);
+        doff += f.dsize;
+        coff += f.csize;
+    }
+    if (coff > tarfs->size) {
+        LOGE("Invalid archive index!");
+        return -1;
+    }
+    tarfs->dctx = ZSTD_createDCtx();
+    if (!tarfs->dctx) {
+        LOGE("Failed to create zstd context.");
+        return -1;
+    }
+    tarfs_build_tree(entries);
+    return 0;
+}
+
+// decompressed frame, loaded on first use. NULL on failure
+FORCE_INLINE const char* tarfs_get_frame(size_t index)
+{
+    tarfs->tick++;
+    for (auto& c : tarfs->cache) {
+        if (c.index == index) {
+            c.used = tarfs->tick;
+            return c.data.get();
+        }
+    }
+    tarfs_cached_frame_s *slot;
+    if (tarfs->cache.size() < TARFS_CACHE_FRAMES) {
+        tarfs->cache.emplace_back();
+        slot = &tarfs->cache.back();
+    } else {
+        slot = &*std::min_element(tarfs->cache.begin(), tarfs->cache.end(), [] (const tarfs_cached_frame_s& a, const tarfs_cached_frame_s& b) {
+            return a.used < b.used;
+        });
+    }
+    const tarfs_frame_s& frame = tarfs->frames[index];
+    slot->index = index;
+    slot->used = tarfs->tick;
+    slot->data.reset(new char[frame.dsize]);
+    tarfs->buf.resize(frame.csize);
+    tarfs_copy(tarfs->frame_coffs[index], tarfs->buf.data(), frame.csize);
+    size_t r = ZSTD_decompressDCtx(tarfs->dctx, slot->data.get(), frame.dsize, tarfs->buf.data(), frame.csize);
+    if (r != frame.dsize) {
+        LOGE("Exception during zstd decompression!");
+        slot->index = SIZE_MAX;
+        return NULL;
+    }
+    return slot->data.get();
+}
+
+// read len bytes at offset of decompressed tar, returns 0 on success
+FORCE_INLINE int tarfs_read(uint64_t offset, char *dst, size_t len)
+{
+    while (len > 0) {
+        auto it = std::upper_bound(tarfs->frame_doffs.begin(), tarfs->frame_doffs.end(), offset);
+        if (it == tarfs->frame_doffs.begin())
+            return -1;
+        size_t index = it - tarfs->frame_doffs.begin() - 1;
+        uint64_t pos = offset - tarfs->frame_doffs[index];
+        if (pos >= tarfs->frames[index].dsize)
+            return -1;
+        const char *frame = tarfs_get_frame(index);
+        if (!frame)
+            return -1;
+        size_t n = std::min<uint64_t>(len, tarfs->frames[index].dsize - pos);
+        memcpy(dst, frame + pos, n);
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+FORCE_INLINE void tarfs_stat(fuse_ino_t ino, struct stat *st)
+{
+    tarfs_node_s& node = tarfs_node(ino);
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ino;
+    st->st_mode = node.mode;
+    st->st_nlink = node.nlink;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = node.size;
+    st->st_blksize = 4096;
+    st->st_blocks = (node.size + 511) / 512;
+    st->st_atime = st->st_mtime = st->st_ctime = node.mtime;
+}
+
+static bool tarfs_valid_ino(fuse_ino_t ino)
+{
+    return ino >= FUSE_ROOT_ID && ino <= tarfs->nodes.size();
+}
+
+static void tarfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    if (!tarfs_valid_ino(parent)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.attr_timeout = TARFS_TIMEOUT;
+    e.entry_timeout = TARFS_TIMEOUT;
+    auto& children = tarfs_node(parent).children;
+    auto it = children.find(name);
+    if (it != children.end()) {
+        e.ino = it->second;
+        tarfs_stat(e.ino, &e.attr);
+    }
+    // ino 0 caches the negative result, interpreters probe lots of missing paths
+    fuse_reply_entry(req, &e);
+}
+
+static void tarfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (!tarfs_valid_ino(ino)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct stat st;
+    tarfs_stat(ino, &st);
+    fuse_reply_attr(req, &st, TARFS_TIMEOUT);
+}
+
+static void tarfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    if (!tarfs_valid_ino(ino) || !S_ISLNK(tarfs_node(ino).mode)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    fuse_reply_readlink(req, tarfs_node(ino).link.c_str());
+}
+
+static void tarfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    if (!tarfs_valid_ino(ino) || !S_ISDIR(tarfs_node(ino).mode)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    tarfs_node_s& node = tarfs_node(ino);
+    std::vector<char> buf(size);
+    size_t pos = 0;
+    off_t i = 0;
+    // entry offset passed to fuse is that of the next entry
+    auto add = [&] (const char *name, fuse_ino_t child) {
+        if (i++ < off)
+            return true;
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = child;
+        st.st_mode = tarfs_node(child).mode;
+        size_t n = fuse_add_direntry(req, buf.data() + pos, size - pos, name, &st, i);
+        if (n > size - pos)
+            return false;
+        pos += n;
+        return true;
+    };
+    if (add(".", ino) && add("..", node.parent)) {
+        for (auto& c : node.children) {
+            if (!add(c.first.c_str(), c.second))
+                break;
+        }
+    }
+    fuse_reply_buf(req, buf.data(), pos);
+}
+
+static void tarfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (!tarfs_valid_ino(ino)) {
+        fuse_reply_err(req, ENOENT);
+    } else if (S_ISDIR(tarfs_node(ino).mode)) {
+        fuse_reply_err(req, EISDIR);
+    } else if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EROFS);
+    } else {
+        fi->keep_cache = 1;
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void tarfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    if (!tarfs_valid_ino(ino)) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    tarfs_node_s& node = tarfs_node(ino);
+    if (off < 0 || (uint64_t) off >= node.size) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    size = std::min<uint64_t>(size, node.size - off);
+    std::vector<char> buf(size);
+    if (tarfs_read(node.offset + off, buf.data(), size) != 0)
+        fuse_reply_err(req, EIO);
+    else
+        fuse_reply_buf(req, buf.data(), size);
+}
+
+/**
+ * tarfs_main - serve embedded archive read-only at mount point given in argv
+ * @mounted: called in the daemonized process once mounted
+ *
+ * Works like fusefs_main of squashfuse. Only the index is loaded at startup, file contents
+ * are decompressed from the frames they span when read.
+ */
+FORCE_INLINE int tarfs_main(int argc, char *argv[], void (*mounted)(void))
+{
+    if (tarfs_load() != 0)
+        return 1;
+
+    struct fuse_lowlevel_ops ops;
+    memset(&ops, 0, sizeof(ops));
+    ops.lookup = tarfs_ll_lookup;
+    ops.getattr = tarfs_ll_getattr;
+    ops.readlink = tarfs_ll_readlink;
+    ops.readdir = tarfs_ll_readdir;
+    ops.open = tarfs_ll_open;
+    ops.read = tarfs_ll_read;
+
+    int r = 1;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint = NULL;
+    if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) == -1) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch) {
+        struct fuse_session *se = fuse_lowlevel_new(&args, &ops, sizeof(ops), NULL);
+        if (se) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                if (fuse_daemonize(0) != -1) {
+                    mounted();
+                    r = fuse_session_loop(se);
+                }
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+        rmdir(mountpoint);
+    }
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+    return r;
+}
+#endif
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "tarfs.h"
+
+// tarindex <frames> <index>: read plain tar from stdin and write its index as a skippable zstd frame.
+// frames lists the zstd frames the tar is split into, one "decompressed_size compressed_size" per line
+int main(int argc, const char **argv) {
+    if (argc < 3) {
+        return 1;
+    }
+    FILE* fp = fopen(argv[1], "r");
+    if (!fp) {
+        LOGE("failed to open frames file");
+        return 1;
+    }
+    std::vector<tarfs_frame_s> frames;
+    unsigned long long dsize, csize;
+    while (fscanf(fp, "%llu %llu", &dsize, &csize) == 2) {
+        frames.push_back(tarfs_frame_s{ dsize, csize });
+    }
+    fclose(fp);
+
+    std::string index;
+    if (tarfs_build_index(stdin, frames, index) != 0) {
+        LOGE("failed to index archive");
+        return 1;
+    }
+    fp = fopen(argv[2], "wb");
+    if (!fp || fwrite(index.data(), 1, index.size(), fp) != index.size() || fclose(fp) != 0) {
+        LOGE("failed to write file");
+        return 1;
+    }
+    return 0;
+}
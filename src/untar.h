@@ -5,10 +5,28 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <fcntl.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <memory>
+#include <algorithm>
+#include <vector>
+#if defined(ARCHIVE_ZSTD)
+#include <zstd.h>
+#elif defined(ARCHIVE_XZ)
+#include <lzma.h>
+#elif defined(ARCHIVE_LZ4)
+#include <lz4frame.h>
+#elif defined(ARCHIVE_LIBDEFLATE)
+#include <libdeflate.h>
+#else
 #include <zlib.h>
+#endif
 #include "utils.h"
 
 // https://mort.coffee/home/tar/
@@ -41,6 +59,17 @@
 
 #define TAR_BLOCK_SIZE 512
 
+// file bodies are written by a pool of threads, so per-file syscall latency of many small files overlaps
+#define UNTAR_WRITER_THREADS 8
+#define UNTAR_CHUNK_SIZE (1 << 20)
+#define UNTAR_QUEUE_SIZE (32 << 20)
+#define UNTAR_BATCH_JOBS 16
+// files with pending writes keep their fd open, at most this many or a quarter of RLIMIT_NOFILE
+#define UNTAR_MAX_OPEN_FILES 256
+
+// decompressed archive data not consumed yet, file bodies bypass it
+#define TAR_STREAM_BUF_SIZE (4 << 20)
+
 struct tar_header_s
 {
     // v7 (pre-POSIX.1-1988)
@@ -130,7 +159,7 @@ struct tar_context_s
 {
     int entry_index;
     int empty_count;
-    FILE *fp_writer;
+    int fd_writer;
     // gnu
     char *longname;
     int longname_wpos;
@@ -320,16 +349,16 @@ FORCE_INLINE int handle_entry_header(tar_context_t *context, tar_header_parsed_t
                     return -1;
                 }
             }
-            int fd = open(entry->path, O_WRONLY | O_CREAT | O_TRUNC, entry->mode);
+            // replace instead of truncating an existing file, which may still have pending writes,
+            // or be a hardlink of another file
+            int fd = open(entry->path, O_WRONLY | O_CREAT | O_EXCL, entry->mode);
+            if (fd < 0 && errno == EEXIST && unlink(entry->path) == 0)
+                fd = open(entry->path, O_WRONLY | O_CREAT | O_EXCL, entry->mode);
             if (fd < 0) {
                 LOGE("Unable to open file for writing");
                 return -1;
             }
-            if ((context->fp_writer = fdopen(fd, "wb")) == NULL) {
-                LOGE("Could not open output file");
-                close(fd);
-                return -1;
-            }
+            context->fd_writer = fd;
             break;
         }
 
@@ -416,7 +445,7 @@ FORCE_INLINE int handle_entry_header(tar_context_t *context, tar_header_parsed_t
     return 0;
 }
 
-FORCE_INLINE int handle_entry_data(tar_context_t *context, tar_header_parsed_t *entry, unsigned char *block, int length)
+FORCE_INLINE int handle_entry_data(tar_context_t *context, tar_header_parsed_t *entry, const char *block, int length)
 {
     switch (entry->typeflag) {
         case TAR_T_LONGNAME:
@@ -437,10 +466,7 @@ FORCE_INLINE int handle_entry_data(tar_context_t *context, tar_header_parsed_t *
             break;
 
         default:
-            if (context->fp_writer != NULL)
-                if (fwrite(block, 1, length, context->fp_writer) != length)
-                    LOGE("Failed to write to output file!");
-            break;
+            break;      // regular file bodies go to writer threads, see untar_file_body
     }
 
     return 0;
@@ -448,11 +474,6 @@ FORCE_INLINE int handle_entry_data(tar_context_t *context, tar_header_parsed_t *
 
 FORCE_INLINE int handle_entry_end(tar_context_t *context, tar_header_parsed_t *entry)
 {
-    if (context->fp_writer != NULL) {
-        fclose(context->fp_writer);
-        context->fp_writer = NULL;
-    }
-
     switch (entry->typeflag) {
         case TAR_T_LONGNAME:
         case TAR_T_LONGLINK:
@@ -465,6 +486,12 @@ FORCE_INLINE int handle_entry_end(tar_context_t *context, tar_header_parsed_t *e
                 LOGE("Failed to parse pax header! ret=%d", r);
             break;
         }
+        case TAR_T_REGULAR1:
+        case TAR_T_REGULAR2:
+        case TAR_T_CONTIGUOUS:
+            // mtime is set by writer thread after the last write
+            reset_overrides(context);
+            break;
         default: {
             // FIXME: directory mtime should be set after all files in it have been extracted
             struct stat st;
@@ -485,32 +512,808 @@ FORCE_INLINE int handle_entry_end(tar_context_t *context, tar_header_parsed_t *e
     return 0;
 }
 
-FORCE_INLINE int read_block(FILE *fp, unsigned char *buffer)
+/*
+ * archive decoder, selected at build time according to archive format: gzip by default,
+ * zstd with -DARCHIVE_ZSTD, xz with -DARCHIVE_XZ, lz4 with -DARCHIVE_LZ4. gzip is decoded
+ * with zlib, or with libdeflate if -DARCHIVE_LIBDEFLATE is defined.
+ * tar_decoder_read() decompresses up to len bytes into dst and returns the number of bytes
+ * produced. status is set to TAR_DECODER_END at end of archive, TAR_DECODER_ERROR on failure.
+ * libdeflate decodes the whole archive up front and has tar_decoder_next() instead, which
+ * returns a pointer into its output.
+ */
+#define TAR_DECODER_OK     0
+#define TAR_DECODER_END    1
+#define TAR_DECODER_ERROR  -1
+
+#if defined(ARCHIVE_ZSTD)
+
+// frames of multi-frame archives are decoded ahead on worker threads
+#define TAR_ZSTD_THREADS 8
+
+static const char tar_decoder_magic[] = "\x28\xb5\x2f\xfd";
+
+struct tar_zstd_frame_s
+{
+    const char *src;
+    size_t csize, dsize;
+    std::unique_ptr<char[]> out;
+    int state;                  // TAR_DECODER_OK while pending, TAR_DECODER_END when decoded
+};
+
+struct tar_zstd_pool_s
 {
-    int num_read = fread(buffer, 1, TAR_BLOCK_SIZE, fp);
-    if (num_read < TAR_BLOCK_SIZE) {
-        LOGE("Not enough data to read! num_read=%d", num_read);
+    std::vector<tar_zstd_frame_s> frames;
+    size_t next = 0;            // next frame to decode
+    size_t current = 0;         // frame being consumed
+    size_t pos = 0;             // consumed bytes of current frame
+    size_t ahead = 0;           // max number of decoded frames not consumed yet
+    bool stop = false;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<std::thread> threads;
+};
+
+struct tar_decoder_s
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer input;
+    size_t hint;                // 0 if last frame is complete and flushed
+    std::unique_ptr<tar_zstd_pool_s> pool;
+    int status;
+};
+
+FORCE_INLINE void tar_zstd_worker(tar_zstd_pool_s *pool)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    std::unique_lock<std::mutex> guard(pool->lock);
+    while (true) {
+        pool->cond.wait(guard, [pool] () {
+            return pool->stop || pool->next >= pool->frames.size() || pool->next < pool->current + pool->ahead;
+        });
+        if (pool->stop || pool->next >= pool->frames.size())
+            break;
+        tar_zstd_frame_s& frame = pool->frames[pool->next++];
+        guard.unlock();
+        frame.out.reset(new char[frame.dsize]);
+        size_t r = dctx ? ZSTD_decompressDCtx(dctx, frame.out.get(), frame.dsize, frame.src, frame.csize) : 0;
+        guard.lock();
+        frame.state = dctx && r == frame.dsize ? TAR_DECODER_END : TAR_DECODER_ERROR;
+        pool->cond.notify_all();
+    }
+    guard.unlock();
+    ZSTD_freeDCtx(dctx);
+}
+
+// split archive into frames, decode them in parallel if there are many and all sizes are known
+FORCE_INLINE void tar_zstd_start_pool(tar_decoder_s *dec, const char *data, size_t size)
+{
+    size_t nthreads = std::min<size_t>(std::thread::hardware_concurrency(), TAR_ZSTD_THREADS);
+    if (nthreads < 2)
+        return;
+    std::unique_ptr<tar_zstd_pool_s> pool(new tar_zstd_pool_s);
+    while (size > 0) {
+        size_t csize = ZSTD_findFrameCompressedSize(data, size);
+        if (ZSTD_isError(csize))
+            return;             // let streaming decoder report the error
+        unsigned long long dsize = ZSTD_getFrameContentSize(data, csize);
+        if (dsize == ZSTD_CONTENTSIZE_UNKNOWN || dsize == ZSTD_CONTENTSIZE_ERROR)
+            return;
+        if (dsize > 0) {        // skip empty and skippable frames
+            tar_zstd_frame_s frame;
+            frame.src = data;
+            frame.csize = csize;
+            frame.dsize = dsize;
+            frame.state = TAR_DECODER_OK;
+            pool->frames.push_back(std::move(frame));
+        }
+        data += csize;
+        size -= csize;
+    }
+    if (pool->frames.size() < 2)
+        return;
+    nthreads = std::min(nthreads, pool->frames.size());
+    pool->ahead = nthreads + 1;
+    for (size_t i = 0; i < nthreads; i++)
+        pool->threads.emplace_back(tar_zstd_worker, pool.get());
+    dec->pool = std::move(pool);
+}
+
+FORCE_INLINE int tar_decoder_init(tar_decoder_s *dec, const char *data, size_t size)
+{
+    dec->status = TAR_DECODER_OK;
+    dec->input.src = data;
+    dec->input.size = size;
+    dec->input.pos = 0;
+    dec->hint = 0;
+    tar_zstd_start_pool(dec, data, size);
+    dec->dctx = dec->pool ? NULL : ZSTD_createDCtx();
+    if (!dec->pool && !dec->dctx) {
+        LOGE("Failed to create zstd context.");
+        return -1;
+    }
+    return 0;
+}
+
+FORCE_INLINE void tar_decoder_end(tar_decoder_s *dec)
+{
+    if (dec->pool) {
+        {
+            std::lock_guard<std::mutex> guard(dec->pool->lock);
+            dec->pool->stop = true;
+        }
+        dec->pool->cond.notify_all();
+        for (auto& t : dec->pool->threads)
+            t.join();
+        dec->pool.reset();
+    }
+    ZSTD_freeDCtx(dec->dctx);
+    dec->dctx = NULL;
+}
+
+// copy decoded bytes out of frames in order, waiting for workers as needed
+FORCE_INLINE size_t tar_zstd_read_frames(tar_decoder_s *dec, char *dst, size_t len)
+{
+    tar_zstd_pool_s *pool = dec->pool.get();
+    size_t done = 0;
+    while (done < len && dec->status == TAR_DECODER_OK) {
+        if (pool->current >= pool->frames.size()) {
+            dec->status = TAR_DECODER_END;
+            break;
+        }
+        tar_zstd_frame_s& frame = pool->frames[pool->current];
+        {
+            std::unique_lock<std::mutex> guard(pool->lock);
+            pool->cond.wait(guard, [&frame] () { return frame.state != TAR_DECODER_OK; });
+        }
+        if (frame.state == TAR_DECODER_ERROR) {
+            LOGE("Exception during zstd decompression!");
+            dec->status = TAR_DECODER_ERROR;
+            break;
+        }
+        size_t n = std::min(len - done, frame.dsize - pool->pos);
+        memcpy(dst + done, frame.out.get() + pool->pos, n);
+        done += n;
+        pool->pos += n;
+        if (pool->pos == frame.dsize) {
+            frame.out.reset();
+            {
+                std::lock_guard<std::mutex> guard(pool->lock);
+                pool->current++;
+                pool->pos = 0;
+            }
+            pool->cond.notify_all();
+        }
+    }
+    return done;
+}
+
+FORCE_INLINE size_t tar_decoder_read(tar_decoder_s *dec, char *dst, size_t len)
+{
+    if (dec->pool)
+        return tar_zstd_read_frames(dec, dst, len);
+    ZSTD_outBuffer output = { dst, len, 0 };
+    while (output.pos < len && dec->status == TAR_DECODER_OK) {
+        if (dec->input.pos >= dec->input.size && dec->hint == 0) {
+            dec->status = TAR_DECODER_END;
+            break;
+        }
+        size_t r = ZSTD_decompressStream(dec->dctx, &output, &dec->input);
+        if (ZSTD_isError(r)) {
+            LOGE("Exception during zstd decompression! %s", ZSTD_getErrorName(r));
+            dec->status = TAR_DECODER_ERROR;
+        } else if (r != 0 && dec->input.pos >= dec->input.size && output.pos < len) {
+            LOGE("Exception during zstd decompression! truncated archive");
+            dec->status = TAR_DECODER_ERROR;
+        }
+        dec->hint = r;
+    }
+    return output.pos;
+}
+
+#elif defined(ARCHIVE_XZ)
+
+#define TAR_XZ_THREADS 8
+
+static const char tar_decoder_magic[] = "\xfd" "7zXZ";
+
+struct tar_decoder_s
+{
+    lzma_stream xs;
+    int status;
+};
+
+FORCE_INLINE int tar_decoder_init(tar_decoder_s *dec, const char *data, size_t size)
+{
+    dec->status = TAR_DECODER_OK;
+    lzma_stream init = LZMA_STREAM_INIT;
+    dec->xs = init;
+#if LZMA_VERSION >= 50040002
+    // blocks of archives created by multi-threaded xz are decoded in parallel
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = std::max<unsigned>(std::min<unsigned>(std::thread::hardware_concurrency(), TAR_XZ_THREADS), 1);
+    mt.memlimit_threading = lzma_physmem() / 4;
+    mt.memlimit_stop = UINT64_MAX;
+    lzma_ret ret = lzma_stream_decoder_mt(&dec->xs, &mt);
+#else
+    lzma_ret ret = lzma_stream_decoder(&dec->xs, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+    if (ret != LZMA_OK) {
+        LOGE("Failed to init xz decoder. ret=%d", ret);
+        return -1;
+    }
+    dec->xs.next_in = (const uint8_t*) data;
+    dec->xs.avail_in = size;
+    return 0;
+}
+
+FORCE_INLINE void tar_decoder_end(tar_decoder_s *dec)
+{
+    lzma_end(&dec->xs);
+}
+
+FORCE_INLINE size_t tar_decoder_read(tar_decoder_s *dec, char *dst, size_t len)
+{
+    dec->xs.next_out = (uint8_t*) dst;
+    dec->xs.avail_out = len;
+    while (dec->xs.avail_out > 0 && dec->status == TAR_DECODER_OK) {
+        // all input is available, so always finish
+        lzma_ret ret = lzma_code(&dec->xs, LZMA_FINISH);
+        if (ret == LZMA_STREAM_END) {
+            dec->status = TAR_DECODER_END;
+        } else if (ret != LZMA_OK) {
+            LOGE("Exception during xz decompression! ret=%d", ret);
+            dec->status = TAR_DECODER_ERROR;
+        }
+    }
+    return len - dec->xs.avail_out;
+}
+
+#elif defined(ARCHIVE_LZ4)
+
+static const char tar_decoder_magic[] = "\x04\x22\x4d\x18";
+
+struct tar_decoder_s
+{
+    LZ4F_dctx *dctx;
+    const char *in;
+    size_t in_remain;
+    size_t hint;                // 0 if last frame is complete
+    int status;
+};
+
+FORCE_INLINE int tar_decoder_init(tar_decoder_s *dec, const char *data, size_t size)
+{
+    dec->status = TAR_DECODER_OK;
+    dec->in = data;
+    dec->in_remain = size;
+    dec->hint = 0;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dec->dctx, LZ4F_VERSION))) {
+        LOGE("Failed to create lz4 context.");
+        return -1;
+    }
+    return 0;
+}
+
+FORCE_INLINE void tar_decoder_end(tar_decoder_s *dec)
+{
+    LZ4F_freeDecompressionContext(dec->dctx);
+}
+
+FORCE_INLINE size_t tar_decoder_read(tar_decoder_s *dec, char *dst, size_t len)
+{
+    size_t done = 0;
+    while (done < len && dec->status == TAR_DECODER_OK) {
+        if (dec->in_remain == 0) {
+            if (dec->hint != 0) {
+                LOGE("Exception during lz4 decompression! truncated archive");
+                dec->status = TAR_DECODER_ERROR;
+            } else {
+                dec->status = TAR_DECODER_END;
+            }
+            break;
+        }
+        // concatenated frames are decoded one after another
+        size_t dst_size = len - done, src_size = dec->in_remain;
+        size_t r = LZ4F_decompress(dec->dctx, dst + done, &dst_size, dec->in, &src_size, NULL);
+        if (LZ4F_isError(r)) {
+            LOGE("Exception during lz4 decompression! %s", LZ4F_getErrorName(r));
+            dec->status = TAR_DECODER_ERROR;
+            break;
+        }
+        dec->in += src_size;
+        dec->in_remain -= src_size;
+        dec->hint = r;
+        done += dst_size;
+    }
+    return done;
+}
+
+#elif defined(ARCHIVE_LIBDEFLATE)
+
+// consumed output is given back to the system in steps of this size
+#define TAR_LIBDEFLATE_RELEASE_SIZE (64 << 20)
+
+static const char tar_decoder_magic[] = "\x1f\x8b";
+
+// libdeflate can't stream, but archive is already in memory, so it is decompressed in one go
+// with libdeflate's simd accelerated inflate. decompressed tar is then served from memory.
+struct tar_decoder_s
+{
+    std::unique_ptr<char[]> out;
+    size_t size, pos;
+    size_t released;            // output before this offset has been released
+    int status;
+};
+
+FORCE_INLINE int tar_decoder_init(tar_decoder_s *dec, const char *data, size_t size)
+{
+    dec->status = TAR_DECODER_OK;
+    dec->size = dec->pos = dec->released = 0;
+    struct libdeflate_decompressor *d = libdeflate_alloc_decompressor();
+    if (!d) {
+        LOGE("Failed to create libdeflate decompressor.");
+        return -1;
+    }
+    // gzip trailer holds uncompressed size modulo 4 GiB
+    size_t out_size = 0;
+    if (size >= 4) {
+        const unsigned char *p = (const unsigned char*) data + size - 4;
+        out_size = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+    // deflate can't expand data by more than 1032 times, stop guessing beyond that
+    size_t max_size = size > SIZE_MAX / 1032 ? SIZE_MAX : size * 1032;
+    enum libdeflate_result r;
+    while (true) {
+        dec->out.reset(new (std::nothrow) char[std::max<size_t>(out_size, 1)]);
+        if (!dec->out) {
+            r = LIBDEFLATE_INSUFFICIENT_SPACE;
+            break;
+        }
+        r = libdeflate_gzip_decompress_ex(d, data, size, dec->out.get(), out_size, NULL, &dec->size);
+        if (r != LIBDEFLATE_INSUFFICIENT_SPACE || out_size >= max_size || max_size - out_size <= UINT32_MAX)
+            break;
+        out_size += (size_t) UINT32_MAX + 1;      // archive is larger than 4 GiB
+    }
+    libdeflate_free_decompressor(d);
+    if (r != LIBDEFLATE_SUCCESS) {
+        LOGE("Exception during libdeflate decompression! ret=%d", r);
+        dec->out.reset();
+        return -1;
+    }
+    return 0;
+}
+
+FORCE_INLINE void tar_decoder_end(tar_decoder_s *dec)
+{
+    dec->out.reset();
+}
+
+// whole output is in memory, so the stream reads it in place instead of copying it out
+#define TAR_STREAM_ZERO_COPY
+
+// returns pointer to the next len bytes of output, NULL if fewer are left
+FORCE_INLINE const char* tar_decoder_next(tar_decoder_s *dec, size_t len)
+{
+    if (dec->size - dec->pos < len)
+        return NULL;
+    const char *p = dec->out.get() + dec->pos;
+    dec->pos += len;
+    if (dec->pos == dec->size)
+        dec->status = TAR_DECODER_END;
+    return p;
+}
+
+// give back output before keep, it has been parsed and written out
+FORCE_INLINE void tar_decoder_release(tar_decoder_s *dec, const char *keep)
+{
+#ifdef __linux__
+    size_t end = keep - dec->out.get();
+    if (end > dec->released) {
+        release_pages(dec->out.get() + dec->released, end - dec->released);
+        dec->released = end;
+    }
+#endif
+}
+
+#else
+
+static const char tar_decoder_magic[] = "\x1f\x8b";
+
+struct tar_decoder_s
+{
+    z_stream zs;
+    const char *in;             // compressed input not yet handed to zlib
+    size_t in_remain;
+    int status;
+};
+
+FORCE_INLINE int tar_decoder_init(tar_decoder_s *dec, const char *data, size_t size)
+{
+    memset(&dec->zs, 0, sizeof(dec->zs));
+    if (inflateInit2(&dec->zs, (15 + 32)) != Z_OK) {
+        LOGE("inflateInit failed while decompressing.");
         return -1;
     }
+    dec->in = data;
+    dec->in_remain = size;
+    dec->status = TAR_DECODER_OK;
     return 0;
 }
 
-FORCE_INLINE int untar(FILE *fp)
+FORCE_INLINE void tar_decoder_end(tar_decoder_s *dec)
+{
+    inflateEnd(&dec->zs);
+}
+
+FORCE_INLINE size_t tar_decoder_read(tar_decoder_s *dec, char *dst, size_t len)
+{
+    size_t done = 0;
+    while (done < len && dec->status == TAR_DECODER_OK) {
+        if (dec->zs.avail_in == 0 && dec->in_remain > 0) {
+            // avail_in is only 32 bits wide
+            dec->zs.next_in = (Bytef*) dec->in;
+            dec->zs.avail_in = std::min<size_t>(dec->in_remain, UINT_MAX);
+            dec->in += dec->zs.avail_in;
+            dec->in_remain -= dec->zs.avail_in;
+        }
+        uInt avail = std::min<size_t>(len - done, UINT_MAX);
+        dec->zs.next_out = (Bytef*) dst + done;
+        dec->zs.avail_out = avail;
+        int ret = inflate(&dec->zs, Z_NO_FLUSH);
+        done += avail - dec->zs.avail_out;
+        if (ret == Z_STREAM_END) {
+            dec->status = TAR_DECODER_END;
+        } else if (ret != Z_OK && !(ret == Z_BUF_ERROR && (dec->zs.avail_in > 0 || dec->in_remain > 0))) {
+            LOGE("Exception during zlib decompression! ret=%d", ret);
+            dec->status = TAR_DECODER_ERROR;
+        }
+    }
+    return done;
+}
+
+#endif
+
+// decompressed archive is read on demand into a buffer, headers are parsed in place and
+// file bodies are decompressed straight into the write job buffers.
+// with TAR_STREAM_ZERO_COPY, both are read in place from decoder output instead.
+struct tar_stream_s
+{
+    tar_decoder_s dec;
+#ifndef TAR_STREAM_ZERO_COPY
+    std::unique_ptr<char[]> buf;
+    size_t pos, end;            // unread output is buf[pos, end)
+#endif
+};
+
+FORCE_INLINE int tar_stream_init(tar_stream_s *st, const char *data, size_t size)
+{
+#ifdef ARCHIVE_ZSTD
+    // leading skippable frames are not part of the tar, e.g. the file index of tarfs.h
+    while (size >= 4 && ((uint8_t) data[0] & 0xf0) == 0x50 && memcmp(data + 1, "\x2a\x4d\x18", 3) == 0) {
+        size_t len = ZSTD_findFrameCompressedSize(data, size);
+        if (ZSTD_isError(len))
+            break;
+        data += len;
+        size -= len;
+    }
+#endif
+    size_t magic_len = sizeof(tar_decoder_magic) - 1;
+    if (size < magic_len || memcmp(data, tar_decoder_magic, magic_len) != 0) {
+        LOGE("Unsupported archive format!");
+        return -1;
+    }
+    if (tar_decoder_init(&st->dec, data, size) != 0)
+        return -1;
+#ifndef TAR_STREAM_ZERO_COPY
+    st->buf.reset(new char[TAR_STREAM_BUF_SIZE]);
+    st->pos = st->end = 0;
+#endif
+    return 0;
+}
+
+FORCE_INLINE void tar_stream_end(tar_stream_s *st)
+{
+    tar_decoder_end(&st->dec);
+#ifndef TAR_STREAM_ZERO_COPY
+    st->buf.reset();
+#endif
+}
+
+#ifdef TAR_STREAM_ZERO_COPY
+
+// returns pointer to the next len bytes, valid until tar_decoder_release() passes it, NULL if archive is truncated
+FORCE_INLINE const char* tar_stream_read(tar_stream_s *st, size_t len)
+{
+    const char *p = tar_decoder_next(&st->dec, len);
+    if (!p)
+        LOGE("Not enough data to read! num_read=%zu", st->dec.size - st->dec.pos);
+    return p;
+}
+
+#else
+
+// returns pointer to the next len (<= TAR_STREAM_BUF_SIZE) bytes, valid until next read, NULL if archive is truncated
+FORCE_INLINE const char* tar_stream_read(tar_stream_s *st, size_t len)
+{
+    if (st->end - st->pos < len) {
+        memmove(st->buf.get(), st->buf.get() + st->pos, st->end - st->pos);
+        st->end -= st->pos;
+        st->pos = 0;
+        st->end += tar_decoder_read(&st->dec, st->buf.get() + st->end, TAR_STREAM_BUF_SIZE - st->end);
+        if (st->end < len) {
+            LOGE("Not enough data to read! num_read=%zu", st->end);
+            return NULL;
+        }
+    }
+    const char *p = st->buf.get() + st->pos;
+    st->pos += len;
+    return p;
+}
+
+// copy next len bytes to dst, bytes not buffered yet are decompressed directly into dst. returns 0 on success
+FORCE_INLINE int tar_stream_read_to(tar_stream_s *st, char *dst, size_t len)
+{
+    size_t n = std::min(len, st->end - st->pos);
+    memcpy(dst, st->buf.get() + st->pos, n);
+    st->pos += n;
+    if (n < len)
+        n += tar_decoder_read(&st->dec, dst + n, len - n);
+    if (n < len) {
+        LOGE("Not enough data to read! num_read=%zu", n);
+        return -1;
+    }
+    return 0;
+}
+
+#endif
+
+struct untar_pool_s;
+
+// file being extracted, shared by its pending write jobs. the last one to finish sets mtime and closes it.
+struct untar_file_s
+{
+    int fd;
+    double mtime;
+    untar_pool_s *pool;
+
+    untar_file_s(int fd, double mtime, untar_pool_s *pool);
+    ~untar_file_s();
+};
+
+struct untar_job_s
+{
+    std::shared_ptr<untar_file_s> file;
+    off_t offset;
+    size_t len;
+    const char *data;
+    std::unique_ptr<char[]> buf;    // owns data, unless it is read in place from the stream
+};
+
+// jobs are handed over in batches, so small files don't cost a thread wakeup each
+typedef std::vector<untar_job_s> untar_batch_t;
+
+struct untar_pool_s
+{
+    std::mutex lock;
+    std::condition_variable cond_pop, cond_push;
+    std::deque<untar_batch_t> batches;
+    size_t queued_size = 0;
+    bool closed = false;
+    int errors = 0;
+#ifdef TAR_STREAM_ZERO_COPY
+    std::multiset<const char*> pending;     // first data of each queued batch, stream output is kept from there on
+#endif
+    int open_files = 0;
+    int max_open_files = UNTAR_MAX_OPEN_FILES;
+    std::vector<std::thread> threads;
+    // filled by reader thread without lock
+    untar_batch_t batch;
+    size_t batch_size = 0;
+};
+
+FORCE_INLINE untar_file_s::untar_file_s(int fd, double mtime, untar_pool_s *pool) : fd(fd), mtime(mtime), pool(pool)
+{
+    std::lock_guard<std::mutex> guard(pool->lock);
+    pool->open_files++;
+}
+
+FORCE_INLINE untar_file_s::~untar_file_s()
+{
+    struct timespec ts[2];
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_NOW;      // atime should be set to now, not atime in archive
+    ts[1].tv_sec = (time_t) mtime;
+    ts[1].tv_nsec = (long) ((mtime - ts[1].tv_sec) * 1000000000);
+    if (futimens(fd, ts) < 0)
+        LOGE("Unable to set mtime and atime");
+    close(fd);
+    std::lock_guard<std::mutex> guard(pool->lock);
+    pool->open_files--;
+    pool->cond_push.notify_one();
+}
+
+FORCE_INLINE void untar_pool_worker(untar_pool_s *pool)
+{
+    std::unique_lock<std::mutex> guard(pool->lock);
+    for (;;) {
+        pool->cond_pop.wait(guard, [=] { return !pool->batches.empty() || pool->closed; });
+        if (pool->batches.empty())
+            break;
+        untar_batch_t batch = std::move(pool->batches.front());
+        pool->batches.pop_front();
+        guard.unlock();
+
+        int errors = 0;
+        size_t size = 0;
+#ifdef TAR_STREAM_ZERO_COPY
+        const char *first = batch.front().data;
+#endif
+        for (auto& job : batch) {
+            size_t done = 0;
+            while (done < job.len) {
+                ssize_t n = pwrite(job.file->fd, job.data + done, job.len - done, job.offset + done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                done += n;
+            }
+            if (done < job.len)
+                errors++;
+            size += job.len;
+            job.buf.reset();
+            job.file.reset();   // may close the file
+        }
+
+        guard.lock();
+#ifdef TAR_STREAM_ZERO_COPY
+        pool->pending.erase(pool->pending.find(first));
+#endif
+        if (errors)
+            LOGE("Failed to write to output file!");
+        pool->errors += errors;
+        pool->queued_size -= size;
+        pool->cond_push.notify_one();
+    }
+}
+
+FORCE_INLINE void untar_pool_start(untar_pool_s *pool)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        pool->max_open_files = std::max<int>(std::min<rlim_t>(UNTAR_MAX_OPEN_FILES, rl.rlim_cur / 4), 1);
+    // writers mostly wait for the filesystem, more threads than cpus still help
+    for (int i = 0; i < UNTAR_WRITER_THREADS; i++)
+        pool->threads.emplace_back(untar_pool_worker, pool);
+}
+
+// hand over current batch, wait if too much data is queued
+FORCE_INLINE void untar_pool_flush(untar_pool_s *pool)
+{
+    if (pool->batch.empty())
+        return;
+    std::unique_lock<std::mutex> guard(pool->lock);
+    pool->cond_push.wait(guard, [=] { return pool->queued_size < UNTAR_QUEUE_SIZE; });
+    pool->queued_size += pool->batch_size;
+#ifdef TAR_STREAM_ZERO_COPY
+    pool->pending.insert(pool->batch.front().data);
+#endif
+    pool->batches.push_back(std::move(pool->batch));
+    pool->cond_pop.notify_one();
+    pool->batch.clear();
+    pool->batch_size = 0;
+}
+
+// wait until another file can be opened without going over max_open_files
+FORCE_INLINE void untar_pool_wait_file(untar_pool_s *pool)
+{
+    std::unique_lock<std::mutex> guard(pool->lock);
+    if (pool->open_files < pool->max_open_files)
+        return;
+    guard.unlock();
+    untar_pool_flush(pool);     // current batch may hold the files being waited for
+    guard.lock();
+    pool->cond_push.wait(guard, [=] { return pool->open_files < pool->max_open_files; });
+}
+
+FORCE_INLINE void untar_pool_push(untar_pool_s *pool, untar_job_s job)
+{
+    pool->batch_size += job.len;
+    pool->batch.push_back(std::move(job));
+    if (pool->batch.size() >= UNTAR_BATCH_JOBS || pool->batch_size >= UNTAR_CHUNK_SIZE)
+        untar_pool_flush(pool);
+}
+
+// wait for all jobs, returns number of failed writes
+FORCE_INLINE int untar_pool_finish(untar_pool_s *pool)
+{
+    untar_pool_flush(pool);
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->closed = true;
+    }
+    pool->cond_pop.notify_all();
+    for (auto& t : pool->threads)
+        t.join();
+    pool->threads.clear();
+    return pool->errors;
+}
+
+#ifdef TAR_STREAM_ZERO_COPY
+// release stream output that every write job is past
+FORCE_INLINE void untar_pool_release(untar_pool_s *pool, tar_stream_s *stream)
+{
+    tar_decoder_s *dec = &stream->dec;
+    if (dec->pos - dec->released < TAR_LIBDEFLATE_RELEASE_SIZE)
+        return;
+    const char *keep = pool->batch.empty() ? dec->out.get() + dec->pos : pool->batch.front().data;
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        if (!pool->pending.empty())
+            keep = std::min(keep, *pool->pending.begin());
+    }
+    tar_decoder_release(dec, keep);
+}
+#endif
+
+// read file body and its padding in chunks and queue them for writing, returns 0 on success
+FORCE_INLINE int untar_file_body(tar_stream_s *stream, untar_pool_s *pool, std::shared_ptr<untar_file_s> file, unsigned long long size)
+{
+#ifdef __linux__
+    // reserve space up front so large files are laid out in one go, failure is harmless
+    if (size >= UNTAR_CHUNK_SIZE)
+        fallocate(file->fd, 0, 0, size);
+#endif
+    unsigned long long offset = 0;
+    while (offset < size) {
+        size_t len = std::min<unsigned long long>(size - offset, UNTAR_CHUNK_SIZE);
+        untar_job_s job;
+#ifdef TAR_STREAM_ZERO_COPY
+        if ((job.data = tar_stream_read(stream, len)) == NULL)
+            return -1;
+#else
+        job.buf.reset(new char[len]);
+        job.data = job.buf.get();
+        if (tar_stream_read_to(stream, job.buf.get(), len) != 0)
+            return -1;
+#endif
+        job.file = file;
+        job.offset = offset;
+        job.len = len;
+        untar_pool_push(pool, std::move(job));
+#ifdef TAR_STREAM_ZERO_COPY
+        untar_pool_release(pool, stream);
+#endif
+        offset += len;
+    }
+    size_t padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    if (padding > 0 && tar_stream_read(stream, padding) == NULL)
+        return -1;
+    return 0;
+}
+
+FORCE_INLINE int untar(tar_stream_s *stream)
 {
     int i;
     int remain_size, current_size;
-    unsigned char buffer[TAR_BLOCK_SIZE + 1];
+    const char *block;
 
     tar_header_parsed_t header_parsed;
     tar_context_t context;
     memset(&context, 0, sizeof(context));
+    context.fd_writer = -1;
+
+    untar_pool_s pool;
+    untar_pool_start(&pool);
 
     while (context.empty_count < 2) {
 
-        if (read_block(fp, buffer) != 0)
+        if ((block = tar_stream_read(stream, TAR_BLOCK_SIZE)) == NULL)
             break;
 
-        for (i = 0; i < TAR_BLOCK_SIZE && !buffer[i]; i++);
+        for (i = 0; i < TAR_BLOCK_SIZE && !block[i]; i++);
         if (i >= TAR_BLOCK_SIZE) {
             context.empty_count++;
             context.entry_index++;
@@ -518,21 +1321,27 @@ FORCE_INLINE int untar(FILE *fp)
         }
         context.empty_count = 0;
         
-        if (parse_header(&context, (tar_header_t*) buffer, &header_parsed) != 0)
+        if (parse_header(&context, (tar_header_t*) block, &header_parsed) != 0)
             break;
 
+        untar_pool_wait_file(&pool);
         if (handle_entry_header(&context, &header_parsed) != 0)
             break;
     
         remain_size = header_parsed.size;
+        if (context.fd_writer >= 0) {
+            auto file = std::make_shared<untar_file_s>(context.fd_writer, header_parsed.mtime, &pool);
+            context.fd_writer = -1;
+            if (untar_file_body(stream, &pool, std::move(file), header_parsed.size) == 0)
+                remain_size = 0;
+        }
         while (remain_size > 0) {
-            if (read_block(fp, buffer) != 0)
+            if ((block = tar_stream_read(stream, TAR_BLOCK_SIZE)) == NULL)
                 break;
 
             current_size = remain_size < TAR_BLOCK_SIZE ? remain_size : TAR_BLOCK_SIZE;
-            buffer[current_size] = 0;
 
-            if (handle_entry_data(&context, &header_parsed, buffer, current_size) != 0)
+            if (handle_entry_data(&context, &header_parsed, block, current_size) != 0)
                 break;
             
             remain_size -= current_size;
@@ -547,84 +1356,17 @@ FORCE_INLINE int untar(FILE *fp)
     }
 
     reset_overrides(&context);
-    return context.empty_count < 2 ? -1 : 0;
-}
-
-FORCE_INLINE int gunzip(char *data, int size, int fd)
-{
-    z_stream zs;                        // z_stream is zlib's control structure
-    memset(&zs, 0, sizeof(zs));
-
-    zs.next_in = (Bytef*)data;
-    zs.avail_in = size;
-
-    if (inflateInit2(&zs, (15 + 32)) != Z_OK) {
-        LOGE("inflateInit failed while decompressing.");
-        return -1;
-    }
-
-    int ret;
-    char outbuffer[8192];
-    int outsize = 0;
-
-    // get the decompressed bytes blockwise using repeated calls to inflate
-    do {
-        zs.next_out = (Bytef*)outbuffer;
-        zs.avail_out = sizeof(outbuffer);
-
-        ret = inflate(&zs, 0);
-
-        if (outsize < zs.total_out) {
-            write(fd, outbuffer, zs.total_out - outsize);
-            outsize = zs.total_out;
-        }
-
-    } while (ret == Z_OK);
-
-    inflateEnd(&zs);
-
-    if (ret != Z_STREAM_END) {          // an error occurred that was not EOF
-        LOGE("Exception during zlib decompression!");
+    if (untar_pool_finish(&pool) != 0)
         return -1;
-    }
-
-    return 0;
+    return context.empty_count < 2 ? -1 : 0;
 }
 
-FORCE_INLINE int extract_tar_gz_from_mem(char *data, int size)
+FORCE_INLINE int extract_tar_from_mem(const char *data, size_t size)
 {
-    int pipe_fds[2];
-    if (pipe(pipe_fds) == -1) {
-        LOGE("Failed to create pipe");
-        return -1;
-    }
-
-    int p = fork();
-    if (p < 0) {
-        LOGE("failed to fork process!");
+    tar_stream_s stream;
+    if (tar_stream_init(&stream, data, size) != 0)
         return -1;
-
-    } else if (p > 0) { // parent process
-        close(pipe_fds[1]);
-        int r;
-        FILE *fp = fdopen(pipe_fds[0], "rb");
-        if (fp != NULL) {
-            r = untar(fp);
-            fclose(fp);
-        } else {
-            LOGE("Could not open pipe fd.");
-            r = -1;
-            close(pipe_fds[0]);
-        }
-
-        kill(p, SIGKILL);
-        waitpid(p, 0, 0);
-        return r;
-
-    } else { // child process
-        close(pipe_fds[0]);
-        int r = gunzip(data, size, pipe_fds[1]);
-        close(pipe_fds[1]);
-        _Exit(r);
-    }
+    int r = untar(&stream);
+    tar_stream_end(&stream);
+    return r;
 }
@@ -5,10 +5,15 @@
 #if defined(__CYGWIN__)
 #include <Windows.h>
 
+// only current process can be checked
+FORCE_INLINE bool is_process_traced(pid_t pid) {
+    return pid == getpid() && IsDebuggerPresent();
+}
+
 FORCE_INLINE void check_debugger(bool full, bool parent) {
     if (parent)
         return;
-    if (IsDebuggerPresent()) {
+    if (is_process_traced(getpid())) {
         LOGD("debugger present on self process!");
         sleep(5);
         exit(1);
@@ -18,13 +23,16 @@ FORCE_INLINE void check_debugger(bool full, bool parent) {
 #elif defined(__APPLE__)
 #include <sys/sysctl.h>
 
-FORCE_INLINE void check_debugger(bool full, bool parent) {
+FORCE_INLINE bool is_process_traced(pid_t pid) {
     struct kinfo_proc info;
     info.kp_proc.p_flag = 0;
     size_t size = sizeof(info);
-    int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, parent ? getppid() : getpid() };
-    if (sysctl(mib, 4, &info, &size, nullptr, 0) == 0 &&
-        (info.kp_proc.p_flag & P_TRACED) != 0) {
+    int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, pid };
+    return sysctl(mib, 4, &info, &size, nullptr, 0) == 0 && (info.kp_proc.p_flag & P_TRACED) != 0;
+}
+
+FORCE_INLINE void check_debugger(bool full, bool parent) {
+    if (is_process_traced(parent ? getppid() : getpid())) {
         LOGD("debugger present on %s process!", parent ? "parent" : "self");
         sleep(5);
         exit(1);
@@ -35,7 +43,12 @@ FORCE_INLINE void check_debugger(bool full, bool parent) {
 #include <sys/wait.h>
 #include <sys/ptrace.h>
 #include <unistd.h>
-#include <fstream>
+#include <fcntl.h>
+#ifdef __FreeBSD__
+#include <sys/sysctl.h>
+#include <sys/user.h>
+#include <sys/proc.h>
+#endif
 
 #if !defined(PT_ATTACHEXC) /* New replacement for PT_ATTACH */
     #if defined(PTRACE_ATTACH)
@@ -50,20 +63,79 @@ FORCE_INLINE void check_debugger(bool full, bool parent) {
     #endif
 #endif
 
-FORCE_INLINE void check_debugger(bool full, bool parent) {
 #ifdef __linux__
-    char path[128];
-    snprintf(path, sizeof(path), OBF("/proc/%d/status"), parent ? getppid() : getpid());
-    std::ifstream ifs(path);
-    std::string line, needle = OBF("TracerPid:\t");
-    pid_t tracer_pid = 0;
-    while (std::getline(ifs, line)) {
-        if (str_starts_with(line, needle)) {
-            tracer_pid = atoi(line.c_str() + needle.size());
-            break;
+// status file kept open and re-read with pread, reopened if pid changes, e.g. after fork
+struct proc_status_file {
+    pid_t pid;
+    int fd;
+};
+
+FORCE_INLINE pid_t get_tracer_pid(struct proc_status_file* f, pid_t pid) {
+    if (f->pid != pid || f->fd == -1) {
+        if (f->fd != -1)
+            close(f->fd);
+        char path[64];
+        snprintf(path, sizeof(path), OBF("/proc/%d/status"), pid);
+        f->fd = open(path, O_RDONLY | O_CLOEXEC);
+        f->pid = pid;
+        if (f->fd == -1)
+            return 0;
+    }
+    char buf[4096];
+    auto n = pread(f->fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    const char* needle = OBF("TracerPid:\t");
+    auto p = strstr(buf, needle);
+    return p ? atoi(p + strlen(needle)) : 0;
+}
+
+FORCE_INLINE int get_ptrace_scope() {
+    static int ptrace_scope = -1;
+    if (ptrace_scope == -1) {
+        ptrace_scope = 0;
+        int fd = open(OBF("/proc/sys/kernel/yama/ptrace_scope"), O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            char buf[16] = {0};
+            if (read(fd, buf, sizeof(buf) - 1) > 0)
+                ptrace_scope = atoi(buf);
+            close(fd);
         }
     }
-    ifs.close();
+    return ptrace_scope;
+}
+#endif
+
+FORCE_INLINE bool is_process_traced(pid_t pid) {
+#ifdef __linux__
+    static struct proc_status_file status_file = {0, -1};
+    return get_tracer_pid(&status_file, pid) != 0;
+#else
+    struct kinfo_proc info;
+    size_t size = sizeof(info);
+    int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, pid };
+    return sysctl(mib, 4, &info, &size, nullptr, 0) == 0 && (info.ki_flag & P_TRACED) != 0;
+#endif
+}
+
+/**
+ * check_debugger - exit if self or parent process is traced
+ * @full: also try to attach with ptrace, which is expensive and only done once per process
+ *
+ * Reading tracer pid is a single pread on linux and a sysctl on freebsd.
+ */
+FORCE_INLINE void check_debugger(bool full, bool parent) {
+    auto pid = parent ? getppid() : getpid();
+#ifdef __linux__
+    static struct proc_status_file status_files[2] = {{0, -1}, {0, -1}};
+    pid_t tracer_pid = get_tracer_pid(&status_files[parent], pid);
+#else
+    struct kinfo_proc info;
+    size_t size = sizeof(info);
+    int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, pid };
+    pid_t tracer_pid = sysctl(mib, 4, &info, &size, nullptr, 0) == 0 && (info.ki_flag & P_TRACED) ? -1 : 0;
+#endif
     if (tracer_pid != 0) {
         LOGD("found tracer on %s process. tracer_pid=%d", parent ? "parent" : "self", tracer_pid);
         sleep(5);
@@ -72,17 +144,19 @@ FORCE_INLINE void check_debugger(bool full, bool parent) {
     if (!full) {
         return;
     }
-    std::ifstream ifs2(OBF("/proc/sys/kernel/yama/ptrace_scope"));
-    int ptrace_scope = 0;
-    ifs2 >> ptrace_scope;
-    ifs2.close();
-    if (getuid() != 0 && ptrace_scope != 0) {
-        LOGD("skip ptrace detection. uid=%d ptrace_scope=%d", getuid(), ptrace_scope);
+    // a tracer attached later is caught by tracer pid check, no need to probe the same process again
+    static pid_t probed_pids[2] = {0, 0};
+    if (probed_pids[parent] == pid) {
+        return;
+    }
+    probed_pids[parent] = pid;
+#ifdef __linux__
+    if (getuid() != 0 && get_ptrace_scope() != 0) {
+        LOGD("skip ptrace detection. uid=%d ptrace_scope=%d", getuid(), get_ptrace_scope());
         return;
     }
 #endif
     if (parent) {
-        auto pid = getppid();
         if (ptrace(PT_ATTACHEXC, pid, 0, 0) == 0) {
             wait(0);
             ptrace(PT_DETACH, pid, 0, 0);
@@ -93,7 +167,6 @@ FORCE_INLINE void check_debugger(bool full, bool parent) {
             exit(1);
         }
     } else {
-        auto pid = getpid();
         int p = fork();
         if (p < 0) {
             LOGE("fork failed");
@@ -114,3 +187,21 @@ FORCE_INLINE void check_debugger(bool full, bool parent) {
     }
 }
 #endif
+
+#ifdef WATCHDOG_INTERVAL
+// called periodically by the lingering child while interpreter runs.
+// signal through pidfd if there is one, so that a recycled pid is never hit
+FORCE_INLINE void watch_debugger(pid_t pid, int pidfd) {
+    if (is_process_traced(pid)) {
+        LOGD("found tracer on parent process by watchdog");
+#ifdef __linux__
+        if (pidfd >= 0 && syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0) == 0)
+            exit(1);
+#endif
+        // without pidfd, pid is still ours as long as it is our parent
+        if (getppid() == pid)
+            kill(pid, SIGKILL);
+        exit(1);
+    }
+}
+#endif
@@ -2,17 +2,33 @@
 #include <string>
 #include <vector>
 #include <random>
+#include <unordered_set>
+#include <iterator>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <ftw.h>
+#include <signal.h>
 #if defined(__linux__)
 #include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #elif defined(__APPLE__)
 #include <mach-o/dyld.h>
+#include <sys/event.h>
 #elif defined(__FreeBSD__)
 #include <sys/sysctl.h>
+#include <sys/event.h>
 #elif defined(__CYGWIN__)
 #include <Windows.h>
 #endif
@@ -133,6 +149,22 @@ FORCE_INLINE int read_all(const char* path, std::vector<char>& buf) {
     return 0;
 }
 
+// write whole buffer, retry on short write and EINTR
+FORCE_INLINE int write_all(int fd, const void *buf, size_t len) {
+    auto p = (const char*) buf;
+    while (len > 0) {
+        auto n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
 static int _remove_file(const char *pathname, const struct stat *sbuf, int type, struct FTW *ftwb) {
     remove(pathname);
     return 0;
@@ -175,62 +207,357 @@ FORCE_INLINE const char* tmpdir() {
     return d && d[0] ? d : "/tmp";
 }
 
+// per-user private directory ssc-<uid> under parent, empty if it can't be used safely
+FORCE_INLINE std::string private_dir(std::string dir) {
+    dir += OBF("/ssc-");
+    dir += std::to_string(getuid());
+    mkdir(dir.c_str(), 0700);
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        LOGD("unsafe private dir %s", dir.c_str());
+        return "";
+    }
+    return dir;
+}
+
+// private directory for state kept between runs, cleared on logout or reboot
+FORCE_INLINE std::string runtime_dir() {
+    const char* runtime_dir = getenv(OBF("XDG_RUNTIME_DIR"));
+    return private_dir(runtime_dir && runtime_dir[0] == '/' ? runtime_dir : tmpdir());
+}
+
+// private directory for data kept across reboots
+FORCE_INLINE std::string cache_dir() {
+    const char* cache_home = getenv(OBF("XDG_CACHE_HOME"));
+    const char* home = getenv(OBF("HOME"));
+    if (cache_home && cache_home[0] == '/') {
+        mkdir(cache_home, 0700);
+        return private_dir(cache_home);
+    }
+    if (home && home[0] == '/') {
+        std::string dir = home;
+        dir += OBF("/.cache");
+        mkdir(dir.c_str(), 0700);
+        return private_dir(dir);
+    }
+    return runtime_dir();
+}
+
+// identity of a file, changes when it is replaced, written or has its attributes changed
+FORCE_INLINE std::string file_stat_key(const struct stat& st) {
+#ifdef __APPLE__
+    uint64_t mtime_ns = st.st_mtimespec.tv_nsec, ctime_ns = st.st_ctimespec.tv_nsec;
+#else
+    uint64_t mtime_ns = st.st_mtim.tv_nsec, ctime_ns = st.st_ctim.tv_nsec;
+#endif
+    std::string key;
+    for (auto n : {(uint64_t) st.st_dev, (uint64_t) st.st_ino, (uint64_t) st.st_size,
+                   (uint64_t) st.st_mtime, mtime_ns, (uint64_t) st.st_ctime, ctime_ns}) {
+        key += ':';
+        key += std::to_string(n);
+    }
+    return key;
+}
+
 #ifdef __linux__
+// returns 1 if process has our pipe open, 0 if not, -1 if process is gone
+FORCE_INLINE int process_has_pipe(const char* pid, const char* pipe_dst) {
+    char path[PATH_MAX];
+    char link_dst[PATH_MAX];
+    auto len = snprintf(path, sizeof(path), OBF("/proc/%s/fd"), pid);
+    auto fd_dir = opendir(path);
+    if (!fd_dir)
+        return errno == ENOENT ? -1 : 0;
+    path[len++] = '/';
+
+    int found = 0;
+    struct dirent *entry;
+    while ((entry = readdir(fd_dir))) {
+        if (entry->d_type != DT_LNK)
+            continue;
+        strcpy(path + len, entry->d_name);
+        auto size = readlink(path, link_dst, sizeof(link_dst) - 1);
+        if (size < 0)
+            continue;
+        link_dst[size] = '\0';
+        if (strcmp(link_dst, pipe_dst) == 0) {
+            found = 1;
+            break;
+        }
+    }
+    closedir(fd_dir);
+    return found;
+}
+
+// subscribe to fork/exec/exit events, requires CAP_NET_ADMIN
+FORCE_INLINE int open_proc_events() {
+    int sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (sock == -1)
+        return -1;
+    struct sockaddr_nl addr = {};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+    addr.nl_pid = 0;
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    alignas(struct nlmsghdr) char req[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))] = {};
+    auto nl = (struct nlmsghdr*) req;
+    auto cn = (struct cn_msg*) NLMSG_DATA(nl);
+    nl->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op));
+    nl->nlmsg_type = NLMSG_DONE;
+    nl->nlmsg_pid = getpid();
+    cn->id.idx = CN_IDX_PROC;
+    cn->id.val = CN_VAL_PROC;
+    cn->len = sizeof(enum proc_cn_mcast_op);
+    *(enum proc_cn_mcast_op*) cn->data = PROC_CN_MCAST_LISTEN;
+    if (send(sock, req, nl->nlmsg_len, 0) != (ssize_t) nl->nlmsg_len) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// collect processes started since last call, returns false if events were lost
+template <typename Set>
+FORCE_INLINE bool read_proc_events(int sock, Set& pids) {
+    alignas(struct nlmsghdr) char buf[8192];
+    for (;;) {
+        auto n = recv(sock, buf, sizeof(buf), 0);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        for (auto nl = (struct nlmsghdr*) buf; NLMSG_OK(nl, n); nl = NLMSG_NEXT(nl, n)) {
+            auto cn = (struct cn_msg*) NLMSG_DATA(nl);
+            auto ev = (struct proc_event*) cn->data;
+            if (ev->what == proc_event::PROC_EVENT_FORK) {
+                pids.insert(ev->event_data.fork.child_tgid);
+            } else if (ev->what == proc_event::PROC_EVENT_EXEC) {
+                pids.insert(ev->event_data.exec.process_tgid);
+            } else if (ev->what == proc_event::PROC_EVENT_EXIT && ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid) {
+                pids.erase(ev->event_data.exit.process_tgid);
+            }
+        }
+    }
+}
+
+/**
+ * check_pipe_reader - exit if another process has opened our pipe
+ *
+ * First call scans fds of all processes. Processes that exist at that time are
+ * trusted afterwards, later calls only scan processes started since then, which
+ * are picked up from proc connector events, or by listing /proc and comparing
+ * entries with the previous listing if events are not available.
+ */
 FORCE_INLINE void check_pipe_reader(int fd) {
     static auto mypid = getpid(), ppid = getppid();
     static char pipe_dst[128] = {0};
+    static int event_sock = -1;
+    static std::unordered_set<uint64_t> known;  // pid and inode of /proc entries seen
+    static std::unordered_set<long> watched;    // processes started after first call
+
+    auto fail = [] (long pid) {
+        LOGD("process %lu is reading our pipe!", pid);
+        sleep(5);
+        exit(1);
+    };
 
     char path[PATH_MAX];
-    int size = 0;
+    // rescan everything on first call, or right away if events were lost since last call
+    bool full_scan = false;
     if (!pipe_dst[0]) {
+        full_scan = true;
         snprintf(path, sizeof(path), OBF("/proc/self/fd/%d"), fd);
-        if ((size = readlink(path, pipe_dst, sizeof(pipe_dst) - 1)) < 0)
+        auto size = readlink(path, pipe_dst, sizeof(pipe_dst) - 1);
+        if (size < 0)
             return;
         pipe_dst[size] = '\0';
+        // subscribe before scanning so nothing is missed in between
+        event_sock = open_proc_events();
+    } else if (event_sock != -1) {
+        full_scan = !read_proc_events(event_sock, watched);
     }
 
-    auto proc_dir = opendir(OBF("/proc"));
-    if (!proc_dir)
-        return;
-
-    char link_dst[PATH_MAX];
-    struct dirent *entry;
-    while ((entry = readdir(proc_dir))) {
-        if (entry->d_type != DT_DIR)
-            continue;
-        char *end = nullptr;
-        auto pid = strtol(entry->d_name, &end, 10);
-        if (!pid || *end)
-            continue;
-        if (pid == mypid || pid == ppid)
-            continue;
-        
-        auto len = snprintf(path, sizeof(path), OBF("/proc/%s/fd"), entry->d_name);
-        auto fd_dir = opendir(path);
-        if (!fd_dir)
-            continue;
-        path[len++] = '/';
-        
-        while ((entry = readdir(fd_dir))) {
-            if (entry->d_type != DT_LNK)
+    if (full_scan || event_sock == -1) {
+        auto proc_dir = opendir(OBF("/proc"));
+        if (!proc_dir)
+            return;
+        struct dirent *entry;
+        while ((entry = readdir(proc_dir))) {
+            if (entry->d_type != DT_DIR)
                 continue;
-            strcpy(path + len, entry->d_name);
-            if ((size = readlink(path, link_dst, sizeof(link_dst) - 1)) < 0)
+            char *end = nullptr;
+            auto pid = strtol(entry->d_name, &end, 10);
+            if (!pid || *end)
                 continue;
-            link_dst[size] = '\0';
-            if (strcmp(link_dst, pipe_dst) == 0) {
-                LOGD("process %lu is reading our pipe!", pid);
-                sleep(5);
-                exit(1);
+            if (pid == mypid || pid == ppid)
+                continue;
+            if (full_scan) {
+                if (process_has_pipe(entry->d_name, pipe_dst) == 1)
+                    fail(pid);
+                if (event_sock == -1)
+                    known.insert((uint64_t) pid << 32 | (uint32_t) entry->d_ino);
+            } else if (known.insert((uint64_t) pid << 32 | (uint32_t) entry->d_ino).second) {
+                // new process, or pid reused
+                watched.insert(pid);
             }
         }
-        closedir(fd_dir);
+        closedir(proc_dir);
+        if (full_scan) {
+            watched.clear();
+            return;
+        }
     }
 
-    closedir(proc_dir);
+    for (auto it = watched.begin(); it != watched.end(); ) {
+        auto pid = *it;
+        if (pid == mypid || pid == ppid) {
+            it = watched.erase(it);
+            continue;
+        }
+        snprintf(path, sizeof(path), "%ld", pid);
+        int ret = process_has_pipe(path, pipe_dst);
+        if (ret == 1)
+            fail(pid);
+        it = ret < 0 ? watched.erase(it) : std::next(it);
+    }
 }
 #endif
 
+#ifdef __linux__
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS   (1024 + 9)
+#define F_SEAL_SEAL   0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW   0x0004
+#define F_SEAL_WRITE  0x0008
+#endif
+
+// drop private copies of pages fully inside [addr, addr + len). for a writable data section,
+// pages go back to their original content in the executable and no longer count as dirty
+// memory, which makes later fork() cheaper.
+FORCE_INLINE void release_pages(void *addr, size_t len) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t beg = ((uintptr_t) addr + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t) addr + len) & ~(page - 1);
+    if (end > beg)
+        madvise((void*) beg, end - beg, MADV_DONTNEED);
+}
+
+// like release_pages, but also zero the partial pages at both ends, so that nothing of
+// [addr, addr + len) stays in private memory. whole pages go back to what the executable has.
+FORCE_INLINE void wipe_pages(void *addr, size_t len) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t beg = ((uintptr_t) addr + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t) addr + len) & ~(page - 1);
+    if (end <= beg) {
+        memset(addr, 0, len);
+        return;
+    }
+    memset(addr, 0, beg - (uintptr_t) addr);
+    memset((void*) end, 0, (uintptr_t) addr + len - end);
+    madvise((void*) beg, end - beg, MADV_DONTNEED);
+}
+
+// anonymous memory file, not close-on-exec so that it can be passed to interpreter.
+// use raw syscall since glibc wrapper is only available since 2.27
+FORCE_INLINE int create_memfd(const char *name) {
+#ifdef SYS_memfd_create
+    return syscall(SYS_memfd_create, name, MFD_ALLOW_SEALING);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// make memfd immutable, so that nobody can modify script after it's written
+FORCE_INLINE int seal_memfd(int fd) {
+    return fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+}
+#endif
+
+#if defined(__linux__) && !defined(SYS_pidfd_open)
+#define SYS_pidfd_open 434
+#endif
+#if defined(__linux__) && !defined(SYS_pidfd_send_signal)
+#define SYS_pidfd_send_signal 424
+#endif
+
+// block until process pid exits, pid must be parent of current process.
+// sleep without periodic wakeups where kernel supports it, unless on_interval
+// is given, which is then called every interval_ms while waiting, with a pidfd
+// of the process if there is one, -1 otherwise.
+FORCE_INLINE void wait_parent_exit(pid_t pid, int interval_ms = -1, void (*on_interval)(pid_t, int) = nullptr) {
+    if (!on_interval)
+        interval_ms = -1;
+#if defined(__linux__)
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd >= 0) {
+        // if parent has exited before pidfd_open, pid may be reused by others
+        if (getppid() == pid) {
+            struct pollfd pfd = { pidfd, POLLIN, 0 };
+            int r;
+            while ((r = poll(&pfd, 1, interval_ms)) <= 0) {
+                if (r == 0)
+                    on_interval(pid, pidfd);
+                else if (errno != EINTR)
+                    break;
+            }
+        }
+        close(pidfd);
+        return;
+    }
+    // before linux 5.3, ask kernel to send a signal when parent exits
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    if (prctl(PR_SET_PDEATHSIG, SIGUSR2) == 0) {
+        struct timespec ts = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+        while (getppid() == pid) {
+            if (!on_interval) {
+                int sig;
+                sigwait(&set, &sig);
+            } else if (sigtimedwait(&set, NULL, &ts) < 0 && errno == EAGAIN && getppid() == pid) {
+                on_interval(pid, -1);
+            }
+        }
+        return;
+    }
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+    int kq = kqueue();
+    if (kq >= 0) {
+        struct kevent ev;
+        EV_SET(&ev, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, NULL);
+        int r = kevent(kq, &ev, 1, NULL, 0, NULL);
+        if (r == 0) {
+            struct timespec ts = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+            int n;
+            while ((n = kevent(kq, NULL, 0, &ev, 1, on_interval ? &ts : NULL)) <= 0) {
+                if (n == 0)
+                    on_interval(pid, -1);
+                else if (errno != EINTR)
+                    break;
+            }
+        }
+        close(kq);
+        if (r == 0 || errno == ESRCH)
+            return;
+    }
+#endif
+    while (getppid() == pid) {
+        if (on_interval) {
+            usleep(interval_ms * 1000);
+            on_interval(pid, -1);
+        } else {
+            sleep(1);
+        }
+    }
+}
+
 class AutoCleaner {
 public:
     ~AutoCleaner() {
@@ -245,6 +572,10 @@ public:
     void add(std::string path) {
         m_paths.emplace_back(std::move(path));
     }
+    // keep the paths, e.g. when they are handed over to another process
+    void release() {
+        m_paths.clear();
+    }
 private:
     std::vector<std::string> m_paths;
 };
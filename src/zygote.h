@@ -0,0 +1,400 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include "obfuscate.h"
+#include "utils.h"
+
+// resident zygote. the first run leaves a daemon behind that keeps the prepared
+// state (checksum verified, files extracted or mounted) and listens on a per-user
+// unix socket. later runs connect, hand over argv, environment, cwd and stdio,
+// and the daemon forks a worker which runs the script with them.
+
+#ifndef ZYGOTE_TIMEOUT
+#define ZYGOTE_TIMEOUT 600  // seconds, daemon exits when idle for this long
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct zygote_request {
+    uint32_t size;      // size of string data following the header
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t fd_mask;   // which of fds 0, 1, 2 are attached
+};
+
+// socket path is keyed on the binary file, a replaced or modified binary gets a new daemon
+FORCE_INLINE std::string zygote_socket_path(const std::string& exe_path) {
+    struct stat st;
+    if (stat(exe_path.c_str(), &st) != 0) {
+        return "";
+    }
+    std::string dir = runtime_dir();
+    if (dir.empty()) {
+        return "";
+    }
+    std::string key = exe_path + file_stat_key(st);
+    char name[32];
+    snprintf(name, sizeof(name), OBF("/%016zx"), std::hash<std::string>()(key));
+    std::string path = dir + name;
+    if (path.size() >= sizeof(((struct sockaddr_un*) 0)->sun_path)) {
+        return "";
+    }
+    return path;
+}
+
+FORCE_INLINE bool zygote_send(int sock, const void* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf = (const char*) buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+FORCE_INLINE bool zygote_recv(int sock, void* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(sock, buf, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf = (char*) buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+FORCE_INLINE int zygote_connect(const std::string& sock_path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path.c_str());
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static volatile pid_t zygote_worker_pid;
+
+static void zygote_forward_signal(int sig) {
+    if (zygote_worker_pid > 0) {
+        kill(zygote_worker_pid, sig);
+    }
+}
+
+/**
+ * zygote_client - run the script in a worker of a running zygote
+ *
+ * Returns -1 if there is no zygote or it went away before starting a worker,
+ * the caller then runs the script on its own. Otherwise returns exit status of
+ * the worker, or raises the signal that killed it.
+ */
+FORCE_INLINE int zygote_client(const std::string& sock_path, int argc, char* argv[]) {
+    if (sock_path.empty()) {
+        return -1;
+    }
+    int sock = zygote_connect(sock_path);
+    if (sock == -1) {
+        return -1;
+    }
+
+    extern char **environ;
+    struct zygote_request req = {};
+    std::string data;
+    for (int i = 0; i < argc; i++) {
+        data.append(argv[i], strlen(argv[i]) + 1);
+    }
+    for (char** e = environ; e && *e; e++, req.envc++) {
+        data.append(*e, strlen(*e) + 1);
+    }
+    char cwd[PATH_MAX];
+    data.append(getcwd(cwd, sizeof(cwd)) ? cwd : "/");
+    data += '\0';
+    req.size = data.size();
+    req.argc = argc;
+
+    int fds[3], nfds = 0;
+    for (int i = 0; i < 3; i++) {
+        if (fcntl(i, F_GETFD) != -1) {
+            req.fd_mask |= 1 << i;
+            fds[nfds++] = i;
+        }
+    }
+    struct iovec iov = {&req, sizeof(req)};
+    char cbuf[CMSG_SPACE(sizeof(fds))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    int32_t pid = 0;
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(req) || !zygote_send(sock, data.data(), data.size())
+            || !zygote_recv(sock, &pid, sizeof(pid)) || pid <= 0) {
+        close(sock);
+        return -1;
+    }
+
+    // worker is not in our process group, pass on signals meant for the script
+    zygote_worker_pid = pid;
+    struct sigaction sa = {};
+    sa.sa_handler = zygote_forward_signal;
+    sa.sa_flags = SA_RESTART;
+    for (int sig : {SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2, SIGWINCH, SIGCONT}) {
+        sigaction(sig, &sa, nullptr);
+    }
+    int32_t status;
+    if (!zygote_recv(sock, &status, sizeof(status))) {
+        LOGD("lost connection to zygote");
+        status = 1 << 8;
+    }
+    close(sock);
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        kill(getpid(), WTERMSIG(status));
+        return 128 + WTERMSIG(status);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+FORCE_INLINE bool zygote_peer_allowed(int sock) {
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(sock, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+FORCE_INLINE int zygote_listen(const std::string& sock_path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path.c_str());
+    int ret = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+    if (ret != 0 && errno == EADDRINUSE) {
+        // remove socket left by a dead zygote, but never one that is alive
+        int sock = zygote_connect(sock_path);
+        if (sock == -1 && errno == ECONNREFUSED) {
+            unlink(sock_path.c_str());
+            ret = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+        } else if (sock != -1) {
+            close(sock);
+        }
+    }
+    if (ret != 0 || listen(fd, 64) != 0) {
+        LOGD("failed to listen on %s err=`%s`", sock_path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// receive request of a client, fork a worker with its stdio, environment and cwd
+FORCE_INLINE void zygote_session(int sock, std::vector<std::string>& args) {
+    struct zygote_request req;
+    int fds[3] = {-1, -1, -1};
+    struct iovec iov = {&req, sizeof(req)};
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(req) || req.size > (64 << 20) || req.argc == 0) {
+        _exit(1);
+    }
+    int nfds = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = std::min<size_t>((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), 3);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+    }
+    std::vector<char> data(req.size);
+    if (!zygote_recv(sock, data.data(), data.size()) || data.empty() || data.back() != '\0') {
+        _exit(1);
+    }
+    std::vector<const char*> strs;
+    for (size_t i = 0; i < data.size(); i += strlen(&data[i]) + 1) {
+        strs.push_back(&data[i]);
+    }
+    if (strs.size() != (size_t) req.argc + req.envc + 1) {
+        _exit(1);
+    }
+
+    int32_t pid = fork();
+    if (pid == 0) {
+        close(sock);
+        for (int i = 0, j = 0; i < 3; i++) {
+            int fd = (req.fd_mask & (1 << i)) && j < nfds ? fds[j++] : open("/dev/null", O_RDWR);
+            dup2(fd, i);
+        }
+        for (int fd : fds) {
+            if (fd > 2) close(fd);
+        }
+        for (int sig : {SIGCHLD, SIGTERM, SIGINT, SIGHUP, SIGPIPE}) {
+            signal(sig, SIG_DFL);
+        }
+        extern char **environ;
+        char** env = (char**) calloc(req.envc + 1, sizeof(*env));
+        for (uint32_t i = 0; i < req.envc; i++) {
+            env[i] = strdup(strs[req.argc + i]);
+        }
+        environ = env;
+        if (chdir(strs.back()) != 0) {
+            LOGD("failed to change directory to %s", strs.back());
+        }
+        args.assign(strs.begin(), strs.begin() + req.argc);
+        return;
+    }
+    for (int fd : fds) {
+        if (fd != -1) close(fd);
+    }
+    int status = 1 << 8;
+    if (zygote_send(sock, &pid, sizeof(pid)) && pid > 0) {
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+        zygote_send(sock, &status, sizeof(status));
+    }
+    _exit(0);
+}
+
+static volatile sig_atomic_t zygote_quit;
+
+static void zygote_on_signal(int sig) {
+    if (sig != SIGCHLD) {
+        zygote_quit = 1;
+    }
+}
+
+/**
+ * zygote_start - fork a zygote daemon holding the current process state
+ * @keep_fds: inherited fds that must stay open in the daemon
+ * @args: set to argv of the client in a worker process
+ *
+ * Returns 1 in a worker forked for a client, which should go on running the
+ * script with @args. In the calling process, returns 0 if the daemon has been
+ * started, in which case it owns everything prepared so far, or -1 on failure.
+ */
+FORCE_INLINE int zygote_start(const std::string& sock_path, const std::vector<int>& keep_fds, std::vector<std::string>& args) {
+    if (sock_path.empty()) {
+        return -1;
+    }
+    int listen_fd = zygote_listen(sock_path);
+    if (listen_fd == -1) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid != 0) {
+        close(listen_fd);
+        if (pid < 0) {
+            unlink(sock_path.c_str());
+            return -1;
+        }
+        while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR);
+        return 0;
+    }
+
+    // detach from terminal and caller, daemon is reparented after intermediate process exits
+    setsid();
+    if (fork() != 0) {
+        _exit(0);
+    }
+    int null_fd = open("/dev/null", O_RDWR);
+    for (int i = 0; i < 3; i++) {
+        dup2(null_fd, i);
+    }
+    int max_fd = std::min<long>(sysconf(_SC_OPEN_MAX), 4096);
+    for (int fd = 3; fd < max_fd; fd++) {
+        if (fd != listen_fd && std::find(keep_fds.begin(), keep_fds.end(), fd) == keep_fds.end()) {
+            close(fd);
+        }
+    }
+    chdir("/");
+
+    struct sigaction sa = {};
+    sa.sa_handler = zygote_on_signal;
+    for (int sig : {SIGCHLD, SIGTERM, SIGINT, SIGHUP}) {
+        sigaction(sig, &sa, nullptr);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int sessions = 0;
+    time_t last_active = time(nullptr);
+    while (!zygote_quit) {
+        while (waitpid(-1, nullptr, WNOHANG) > 0) {
+            sessions--;
+            last_active = time(nullptr);
+        }
+        time_t idle = time(nullptr) - last_active;
+        if (sessions <= 0 && idle >= ZYGOTE_TIMEOUT) {
+            break;
+        }
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        int timeout = sessions > 0 ? ZYGOTE_TIMEOUT : ZYGOTE_TIMEOUT - idle;
+        if (poll(&pfd, 1, timeout * 1000) <= 0) {
+            continue;
+        }
+        int sock = accept(listen_fd, nullptr, nullptr);
+        if (sock == -1) {
+            continue;
+        }
+        last_active = time(nullptr);
+        if (!zygote_peer_allowed(sock)) {
+            close(sock);
+            continue;
+        }
+        pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            zygote_session(sock, args);
+            return 1;
+        } else if (pid > 0) {
+            sessions++;
+        }
+        close(sock);
+    }
+    // unlink before closing, so clients never see a refused connection and take over a live socket path
+    unlink(sock_path.c_str());
+    close(listen_fd);
+    exit(0);
+}